@@ -1,111 +1,880 @@
 #include<string.h>
 #include<stdlib.h>
 #include<stdio.h>
-
-const int INITIAL_MALLOC = 10;
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<stdint.h>
+#include<limits.h>
+#include<time.h>
+#include<sys/resource.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<signal.h>
+#include<errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#endif
+#include "a2.h"
+
+// Everything but the a2_* functions of a2.h is static, so the library exports no other symbol
+// Without main the command line's own helpers go unused and are left out by the compiler
+#ifdef A2_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+
+static const int INITIAL_MALLOC = 10;
+static const size_t ARENA_BLOCK_SIZE = 1 << 20;
+static const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+static const size_t READ_CHUNK_SIZE = 1 << 16; // Initial buffer of a LineReader, grows only for longer lines
+static const size_t RUN_READ_SIZE = 1 << 14; // Initial buffer of a RunReader, grows only for longer lines
+static const int SERVE_IDLE_SECONDS = 30; // A --serve client silent this long is disconnected, freeing its worker
+static const int SERVE_RETRY_MS = 100; // Pause of a --serve worker after accept() runs out of descriptors or memory
+static const int MERGE_FAN_IN = 64; // Most runs merged at once, more are first merged in groups into longer runs
+static const int PARALLEL_SORT_THRESHOLD = 1 << 14; // Ranges smaller than this are always sorted serially
+static const int PARALLEL_PARSE_THRESHOLD = 1 << 14; // Fewer lines than this are always parsed serially
+#define RECORD_FIELDS 8 // Text fields of an international record, domestic records have no TOEFL
+#define LINE_BLOCK 64 // Lines shorter than this can take the vectorized parse fast path
+static const int RADIX_NAME_PREFIX = 13; // Bytes of the lower case last name packed into a radix key
+static const int ADAPTIVE_MIN_GALLOP = 7; // Wins in a row by one run before an adaptive merge starts galloping
+#define ADAPTIVE_MAX_RUNS 85 // Pending runs of an adaptive sort, enough for any int count of students
+#define AGGREGATE_GPAS 4301 // Distinct GPAs in thousandths, 0.000 to 4.300
+#define AGGREGATE_YEARS 61 // Birth years 1950 to 2010
+#define AGGREGATE_TOEFLS 121 // TOEFL scores 0 to 120
+static const char SNAPSHOT_MAGIC[8] = "A2SNAP2";
+static const char SNAPSHOT_OPEN_FAILED[] = "Cannot open snapshot file"; // Errors of open_snapshot(), compared by pointer
+static const char SNAPSHOT_INVALID[] = "Invalid snapshot file";
+static const char RECORD_FILTERED[] = "Filtered out"; // Returned by parse_record() for valid rows a filter rejects
+static const char A2_STOPPED[] = "The job stopped at a bad line and must be reset";
 
 typedef enum {
     DOMESTIC,
     INTERNATIONAL,
 } StudentType;
 
+// Students stored column by column, row i of every array describes the same student
+// Each array is contiguous, so a sort or filter only touches the columns it reads
+// The strings (record text and name keys) live in the arena of the run, the string heap
 typedef struct {
-    char *first_name;
-    char *last_name;
-    char *birth_year;
-    char *birth_month;
-    char *birth_day;
-    char *gpa_str;
-} DomesticStudent;
+    int count;
+    int capacity;
+    int *birth_date; // year * 10000 + month * 100 + day
+    short *gpa; // Thousandths, GPA is validated to at most 3 decimal places
+    short *status; // -1 for domestic, TOEFL score for international
+    unsigned char *type; // StudentType
+    char **name_key; // Lower case "last\0first\0", used only for ordering
+    char **text; // Fields in output order, each ended by a null byte, see build_student()
+    int *text_length; // Without the final null byte
+} StudentStore;
+
+// One block of an arena, blocks are chained so earlier allocations never move
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator owning all record strings and line buffers of a run, released in one shot
+typedef struct {
+    ArenaBlock *head;
+    size_t allocated; // Total bytes held in blocks
+    size_t used; // Total bytes handed out
+} Arena;
+
+typedef enum {
+    ON_ERROR_EXIT, // Report the first bad line and stop
+    ON_ERROR_SKIP, // Drop bad lines, list them on stderr and sort the rest
+    ON_ERROR_REPORT, // Validate every line and write all errors instead of the sorted output
+} ErrorMode;
+
+// Bad line found while validating, line is 1-based
+typedef struct {
+    int line;
+    const char *message;
+    const char *source; // Input path when several files are read, NULL otherwise
+} LineError;
+
+// Errors in line order
+typedef struct {
+    LineError *errors;
+    int count;
+    int capacity;
+} ErrorLog;
+
+typedef enum {
+    SORT_MERGE,
+    SORT_RADIX,
+    SORT_ADAPTIVE,
+} SortEngine;
+
+// Row filters from --min-gpa, --min-year, --max-year and --min-toefl
+// The defaults let every student through, a domestic student's status of -1 fails any TOEFL filter
+typedef struct {
+    int active; // 0 when no filter was given, so the check costs one branch
+    int min_gpa; // Thousandths
+    int min_year;
+    int max_year;
+    int min_toefl;
+} RecordFilter;
+
+// Optional flags given after the three positional arguments
+typedef struct {
+    int zero_copy; // Keep record fields as views into the input buffer instead of copying them
+    // Worker threads of the sort and the parse, file workers of several inputs and --serve workers
+    // 1 keeps everything on the main thread
+    int threads;
+    SortEngine sort_engine;
+    int verify_sort; // Also run the merge sort and fail if the orders differ
+    size_t memory_budget; // Bytes of records held in memory before spilling sorted runs, 0 keeps everything
+    ErrorMode error_mode;
+    char *extra_outputs[3]; // Paths given with --emit for options 1, 2 and 3, NULL if not requested
+    int stats; // Print phase timings and counters to stderr
+    char *stats_path; // JSON file for the same numbers, NULL if not requested
+    int limit; // Students written per output, 0 writes them all
+    char *snapshot_path; // Sorted snapshot the input is appended to, NULL to sort the input alone
+    char *save_snapshot_path; // Where to save the sorted result as a snapshot, NULL if not requested
+    char *aggregate_path; // JSON file for the summary of the students, NULL if not requested
+    RecordFilter filter;
+} RunOptions;
+
+// Summary of the valid students of a run, counted as they are parsed (--aggregate)
+// Every field has a small fixed range, so each is kept as an exact histogram and percentiles
+// are exact rather than estimated from a sketch
+typedef struct {
+    long domestic;
+    long international;
+    long gpa[AGGREGATE_GPAS]; // Students per GPA in thousandths
+    long year[AGGREGATE_YEARS]; // Students per birth year - 1950
+    long toefl[AGGREGATE_TOEFLS]; // International students per score
+} Aggregates;
+
+// Student indexes split by type, each list sorted independently
+typedef struct {
+    int *domestic;
+    int domestic_count;
+    int *international;
+    int international_count;
+} Partitions;
+
+// The first limit students of each type in comparator order, kept while the input streams by
+// Each type has a max-heap of rows whose root is the last kept student, so a new student only
+// needs one comparison against the root to be rejected
+typedef struct {
+    StudentStore store; // Kept students of both types
+    char **owned; // Buffer of each row holding its text and name key
+    size_t *owned_size;
+    int *sequence; // Line number of each row, ties go to the earlier line
+    int *heap[2]; // Rows per StudentType
+    int heap_size[2];
+    int limit;
+} TopK;
+
+// One requested output: option 1, 2 or 3 written to fp
+typedef struct {
+    int option;
+    FILE *fp;
+} OutputTarget;
+
+// Temp file of sorted runs written one after another, run i is bytes run_start[i] up to
+// run_start[i + 1]
+// Runs hold no descriptor of their own, so any number of them fits in one file
+typedef struct {
+    FILE *fp;
+    off_t *run_start;
+    int run_count;
+    int run_capacity;
+} SpillFile;
+
+// Sorted run read back one record at a time during the k-way merge
+// Reads go through its own buffer with pread(2), so every run of a spill file shares its descriptor
+typedef struct {
+    int fd;
+    off_t offset; // Next byte of the run to read
+    off_t end;
+    char *buffer;
+    size_t capacity;
+    size_t start; // First buffered byte not handed out yet
+    size_t used;
+    Arena arena; // Holds only the current record, reset before each read
+    StudentStore current; // One row
+} RunReader;
+
+// One range of a parallel merge sort, depth is how many more levels may still fork
+typedef struct {
+    const StudentStore *store;
+    int *order;
+    int *scratch;
+    int start;
+    int end;
+    int depth;
+} SortTask;
+
+// One adaptive sort of an index list: the stack of sorted runs still to merge, run i covers
+// order[run_start[i]..run_start[i] + run_length[i] - 1]
+// min_gallop starts at ADAPTIVE_MIN_GALLOP and moves with how well galloping pays off
+typedef struct {
+    const StudentStore *store;
+    int *order;
+    int *scratch;
+    int run_start[ADAPTIVE_MAX_RUNS];
+    int run_length[ADAPTIVE_MAX_RUNS];
+    int run_count;
+    int min_gallop;
+    long comparisons;
+} AdaptiveSort;
+
+// Contiguous range of lines parsed by one worker into its rows of the store
+typedef struct {
+    char **lines;
+    StudentStore *store;
+    int first_row; // Row of line 0
+    int start;
+    int end;
+    int zero_copy;
+    const RecordFilter *filter;
+    int stop_on_error;
+    Arena arena;
+    ErrorLog errors;
+    Aggregates *aggregates; // Students of this chunk alone, NULL unless aggregating
+} ParseChunk;
+
+// Fixed width radix key, compared as one big endian 128 bit number (high then low)
+// Bytes: year - 1950, month, day, then the first RADIX_NAME_PREFIX bytes of the
+// lower case last name padded with zeros
+typedef struct {
+    uint64_t high;
+    uint64_t low;
+    int index;
+} RadixItem;
+
+// Output file written through one large buffer with write(2), no stdio formatting or locking
+typedef struct {
+    int fd;
+    char *buffer;
+    size_t used;
+    int failed; // A write failed, nothing more is written
+} OutputWriter;
 
+// Validated fields of one line (views into the line) plus the decoded ordering values
 typedef struct {
+    StudentType type;
     char *first_name;
     char *last_name;
     char *birth_year;
     char *birth_month;
     char *birth_day;
     char *gpa_str;
-    char *TOEFL_score;
-} InternationalStudent;
+    char *type_token; // "D" or "I"
+    char *TOEFL_score; // NULL for domestic students
+    int birth_date; // Same encodings as StudentStore
+    int gpa;
+    int status;
+} RecordFields;
+
+// Character class bitmasks of one line, bit i describes byte i
+typedef struct {
+    uint64_t space;
+    uint64_t dash;
+    uint64_t digit;
+    uint64_t dot;
+} LineMasks;
+
+// Reads lines from any stream, pipes and stdin included, through one reusable buffer
+// Bytes are read in chunks, a line cut by the end of a chunk is moved to the front of the buffer
+// and completed by the next read
+typedef struct {
+    FILE *fp;
+    char *buffer;
+    size_t capacity;
+    size_t start; // First byte not handed out yet
+    size_t end; // End of the bytes read so far
+    size_t bytes_read;
+    int eof;
+} LineReader;
+
+// Input file mapped into memory, lines are handed out as views into data
+typedef struct {
+    char *data;
+    size_t size;
+    size_t mapped_size;
+} MappedInput;
 
-typedef union {
-    InternationalStudent international;
-    DomesticStudent domestic;
-} StudentUnion;
+// One of several input files, read, parsed and sorted on its own by a file worker
+typedef struct {
+    const char *path; // "-" is stdin
+    int opened;
+    int empty; // No bytes at all, rejected like a single empty input
+    int verified; // 0 if --verify-sort found a differing order
+    MappedInput mapped;
+    char **lines;
+    int line_count;
+    size_t bytes_read;
+    Arena arena;
+    StudentStore store;
+    int *order; // Combined order (option 3) of the file's students
+    ErrorLog errors;
+    Aggregates *aggregates; // Students of this file, NULL unless aggregating
+} InputFile;
+
+// Input files handed out in argument order to a pool of file workers
+typedef struct {
+    InputFile *files;
+    int file_count;
+    int next; // Next file to take, shared by the workers
+    RunOptions options; // Settings for a single file, every bad line is collected
+} InputPool;
 
-// Stores student type and student info so all students can be stored together
+// Sorted students of one input file during the k-way merge, position is the next one out
 typedef struct {
-    StudentType type;
-    StudentUnion student;
-} Student;
+    const StudentStore *store;
+    const int *order;
+    int count;
+    int position;
+} MergeSource;
+
+// Shared by the --serve workers, read only once they start
+typedef struct {
+    int listen_fd;
+    RunOptions options; // Settings of every job
+} Server;
+
+// One job of the library, see a2.h
+struct A2Context {
+    RunOptions options;
+    Arena arena; // Lines read from streams, copied buffers and name keys
+    StudentStore store;
+    MappedInput *mappings; // Inputs and the snapshot the students may point into
+    int mapping_count;
+    int mapping_capacity;
+    int sorted_rows; // Rows loaded from a snapshot, already in comparator order
+    ErrorLog errors;
+    Partitions partitions;
+    int *combined; // Option 3 order, built by the first a2_write() that needs it
+    int sorted;
+    int stopped; // An --on-error exit load stopped at a bad line, nothing runs until a2_reset()
+    const char *message; // Last failure
+    int aggregate; // Count the students in aggregates, set with --aggregate
+    Aggregates aggregates; // Every student loaded so far
+};
+
+// Start of a snapshot file: validated students in the option 3 order, laid out so the file can
+// be mapped and written out as is
+// Every other field is the file offset of one section, each section starts 8 byte aligned
+// Row i of every column is the i-th student, strings are offsets into the string table, which
+// holds the record text and the name key of every row
+// All numbers are in the byte order of the machine that wrote the file
+typedef struct {
+    char magic[8]; // SNAPSHOT_MAGIC
+    int64_t count;
+    int64_t domestic_count;
+    int64_t birth_dates; // int32_t per row
+    int64_t gpas; // int16_t per row
+    int64_t statuses; // int16_t per row, the type follows from it
+    int64_t text_lengths; // int32_t per row, without the final null byte
+    int64_t text_offsets; // int64_t per row
+    int64_t name_key_offsets; // int64_t per row
+    int64_t domestic_rows; // int32_t per domestic student, option 1 in order
+    int64_t international_rows; // int32_t per international student, option 2 in order
+    int64_t strings;
+    int64_t strings_size;
+} SnapshotHeader;
+
+typedef enum {
+    PHASE_READ,
+    PHASE_PARSE,
+    PHASE_SORT,
+    PHASE_OUTPUT,
+    PHASE_COUNT,
+} Phase;
+
+// Phase timings and counters of one run, only collected while enabled
+typedef struct {
+    int enabled;
+    double wall_start[PHASE_COUNT];
+    double cpu_start[PHASE_COUNT];
+    double wall[PHASE_COUNT]; // Seconds, summed over every time the phase was entered
+    double cpu[PHASE_COUNT]; // Process CPU seconds, every thread included
+    size_t bytes_read;
+    long lines; // Lines handed to the parser
+    long records; // Lines that became students
+    // Comparator calls of the merge and adaptive sorts, snapshot merges and --verify-sort included
+    // The radix sort, --limit heaps and the merges of runs and input files don't count theirs
+    long comparisons;
+    long allocations; // Arena blocks and column buffers requested from malloc
+} RunStats;
+
+static const char *PHASE_NAMES[PHASE_COUNT] = {"read", "parse", "sort", "output"};
+
+// Global like classify_line so sort and parse workers can count without extra arguments
+// Counters that workers touch are updated with atomic adds
+static RunStats run_stats;
+
+static double clock_seconds(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
 
 /*
-Takes fp and line array pointer and loads the file line by line to an array
-Must manage realloction as the input size is variable
-Also keep track of line_count
-Returns pointer to string array
-No format error handling
+Starts timing a phase, does nothing unless stats are enabled
 */
-char** read_lines(FILE *input_fp, int size, int *line_count) {
-    int current_capacity = INITIAL_MALLOC;
-    char **lines = (char **) malloc(sizeof(char *) * INITIAL_MALLOC);
-    if (lines == NULL) {
+static void stats_begin(Phase phase) {
+    if (!run_stats.enabled) return;
+    run_stats.wall_start[phase] = clock_seconds(CLOCK_MONOTONIC);
+    run_stats.cpu_start[phase] = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void stats_end(Phase phase) {
+    if (!run_stats.enabled) return;
+    run_stats.wall[phase] += clock_seconds(CLOCK_MONOTONIC) - run_stats.wall_start[phase];
+    run_stats.cpu[phase] += clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - run_stats.cpu_start[phase];
+}
+
+static void stats_add(long *counter, long amount) {
+    if (run_stats.enabled) __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1) return -1;
+    return usage.ru_maxrss;
+}
+
+/*
+Writes the stats as a small table, meant for stderr
+*/
+static void write_stats_text(FILE *fp, int error_count) {
+    fprintf(fp, "%-12s %10s %10s\n", "phase", "wall_s", "cpu_s");
+    double wall = 0, cpu = 0;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        fprintf(fp, "%-12s %10.4f %10.4f\n", PHASE_NAMES[p], run_stats.wall[p], run_stats.cpu[p]);
+        wall += run_stats.wall[p];
+        cpu += run_stats.cpu[p];
+    }
+    fprintf(fp, "%-12s %10.4f %10.4f\n", "total", wall, cpu);
+    fprintf(fp, "%-12s %zu\n", "bytes_read", run_stats.bytes_read);
+    fprintf(fp, "%-12s %ld\n", "lines", run_stats.lines);
+    fprintf(fp, "%-12s %ld\n", "records", run_stats.records);
+    fprintf(fp, "%-12s %d\n", "errors", error_count);
+    fprintf(fp, "%-12s %ld\n", "comparisons", run_stats.comparisons);
+    fprintf(fp, "%-12s %ld\n", "allocations", run_stats.allocations);
+    fprintf(fp, "%-12s %ld\n", "peak_rss_kb", peak_rss_kb());
+}
+
+/*
+Writes the same numbers as write_stats_text() as one JSON object
+*/
+static void write_stats_json(FILE *fp, int error_count) {
+    fprintf(fp, "{\n  \"phases\": {\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        fprintf(fp, "    \"%s\": {\"wall_seconds\": %.6f, \"cpu_seconds\": %.6f}%s\n", PHASE_NAMES[p],
+                run_stats.wall[p], run_stats.cpu[p], p + 1 < PHASE_COUNT ? "," : "");
+    }
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"bytes_read\": %zu,\n", run_stats.bytes_read);
+    fprintf(fp, "  \"lines\": %ld,\n", run_stats.lines);
+    fprintf(fp, "  \"records\": %ld,\n", run_stats.records);
+    fprintf(fp, "  \"errors\": %d,\n", error_count);
+    fprintf(fp, "  \"comparisons\": %ld,\n", run_stats.comparisons);
+    fprintf(fp, "  \"allocations\": %ld,\n", run_stats.allocations);
+    fprintf(fp, "  \"peak_rss_kb\": %ld\n}\n", peak_rss_kb());
+}
+
+/*
+Counts one valid student of the store
+Values outside a histogram are only counted by type, validation keeps them out of every store
+*/
+static void aggregate_student(Aggregates *aggregates, const StudentStore *store, int row) {
+    int gpa = store->gpa[row];
+    int year = store->birth_date[row] / 10000 - 1950;
+    if (gpa >= 0 && gpa < AGGREGATE_GPAS) aggregates->gpa[gpa]++;
+    if (year >= 0 && year < AGGREGATE_YEARS) aggregates->year[year]++;
+    if (store->type[row] == DOMESTIC) {
+        aggregates->domestic++;
+    } else {
+        aggregates->international++;
+        if (store->status[row] >= 0 && store->status[row] < AGGREGATE_TOEFLS) aggregates->toefl[store->status[row]]++;
+    }
+}
+
+static void aggregate_merge(Aggregates *dest, const Aggregates *src) {
+    dest->domestic += src->domestic;
+    dest->international += src->international;
+    for (int i = 0; i < AGGREGATE_GPAS; i++) dest->gpa[i] += src->gpa[i];
+    for (int i = 0; i < AGGREGATE_YEARS; i++) dest->year[i] += src->year[i];
+    for (int i = 0; i < AGGREGATE_TOEFLS; i++) dest->toefl[i] += src->toefl[i];
+}
+
+/*
+Returns the nearest rank percentile of a histogram: the smallest value with at least percent% of
+the total at or below it. 0 gives the minimum, total must be positive
+*/
+static int histogram_percentile(const long *counts, int size, long total, int percent) {
+    long rank = (total * percent + 99) / 100;
+    if (rank < 1) rank = 1;
+    long seen = 0;
+    for (int value = 0; value < size; value++) {
+        seen += counts[value];
+        if (seen >= rank) return value;
+    }
+    return size - 1;
+}
+
+/*
+Writes mean, minimum, percentiles and maximum of a histogram as the members of a JSON object
+scale turns values into units, 1000 for GPA thousandths
+*/
+static void write_distribution_json(FILE *fp, const long *counts, int size, long total, int scale) {
+    const int percents[] = {0, 25, 50, 75, 90, 99, 100};
+    const char *names[] = {"min", "p25", "p50", "p75", "p90", "p99", "max"};
+    double sum = 0;
+    for (int value = 0; value < size; value++) sum += (double) counts[value] * value;
+    int decimals = scale == 1000 ? 3 : 0;
+    fprintf(fp, "\"mean\": %.3f", sum / total / scale);
+    for (int i = 0; i < 7; i++) {
+        fprintf(fp, ", \"%s\": %.*f", names[i], decimals,
+                (double) histogram_percentile(counts, size, total, percents[i]) / scale);
+    }
+}
+
+/*
+Writes the summary as JSON: counts by type, GPA distribution with a histogram in steps of 0.1,
+students per birth year and the TOEFL distribution of international students
+A distribution without students is null
+*/
+static void write_aggregates_json(FILE *fp, const Aggregates *aggregates) {
+    long students = aggregates->domestic + aggregates->international;
+    fprintf(fp, "{\n  \"students\": %ld,\n", students);
+    fprintf(fp, "  \"domestic\": %ld,\n", aggregates->domestic);
+    fprintf(fp, "  \"international\": %ld,\n", aggregates->international);
+
+    fprintf(fp, "  \"gpa\": ");
+    if (students == 0) {
+        fprintf(fp, "null,\n");
+    } else {
+        fprintf(fp, "{");
+        write_distribution_json(fp, aggregates->gpa, AGGREGATE_GPAS, students, 1000);
+        // Bucket "x.y" holds GPAs from x.y up to but not including x.y + 0.1
+        fprintf(fp, ",\n    \"histogram\": {");
+        for (int bucket = 0; bucket * 100 < AGGREGATE_GPAS; bucket++) {
+            long count = 0;
+            for (int gpa = bucket * 100; gpa < (bucket + 1) * 100 && gpa < AGGREGATE_GPAS; gpa++) {
+                count += aggregates->gpa[gpa];
+            }
+            fprintf(fp, "%s\"%d.%d\": %ld", bucket > 0 ? ", " : "", bucket / 10, bucket % 10, count);
+        }
+        fprintf(fp, "}},\n");
+    }
+
+    fprintf(fp, "  \"birth_years\": {");
+    int first = 1;
+    for (int i = 0; i < AGGREGATE_YEARS; i++) {
+        if (aggregates->year[i] == 0) continue;
+        fprintf(fp, "%s\"%d\": %ld", first ? "" : ", ", 1950 + i, aggregates->year[i]);
+        first = 0;
+    }
+    fprintf(fp, "},\n");
+
+    fprintf(fp, "  \"toefl\": ");
+    if (aggregates->international == 0) {
+        fprintf(fp, "null\n}\n");
+    } else {
+        fprintf(fp, "{");
+        write_distribution_json(fp, aggregates->toefl, AGGREGATE_TOEFLS, aggregates->international, 1);
+        fprintf(fp, "}\n}\n");
+    }
+}
+
+/*
+Returns memory from malloc(), calloc() or realloc(), ends the program if there was none
+*/
+static void* check_allocation(void *memory) {
+    if (memory == NULL) {
         perror("Failed to allocate.");
         exit(EXIT_FAILURE);
     }
+    return memory;
+}
+
+/*
+Returns size bytes from the arena, aligned for any record type
+Starts a new block when the current one is full, oversized requests get their own block
+*/
+static void* arena_alloc(Arena *arena, size_t size) {
+    size_t aligned = (size + 7) & ~(size_t) 7;
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->capacity - block->used < aligned) {
+        size_t capacity = aligned > ARENA_BLOCK_SIZE ? aligned : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock *) check_allocation(malloc(sizeof(ArenaBlock) + capacity));
+        block->next = arena->head;
+        block->used = 0;
+        block->capacity = capacity;
+        arena->head = block;
+        arena->allocated += capacity;
+        stats_add(&run_stats.allocations, 1);
+    }
+    void *memory = block->data + block->used;
+    block->used += aligned;
+    arena->used += aligned;
+    return memory;
+}
+
+/*
+Frees every block at once, all pointers handed out by the arena become invalid
+*/
+static void arena_release(Arena *arena) {
+    ArenaBlock *block = arena->head;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->allocated = 0;
+    arena->used = 0;
+}
+
+/*
+Moves every block of src into dest, src is left empty
+*/
+static void arena_absorb(Arena *dest, Arena *src) {
+    if (src->head == NULL) return;
+    ArenaBlock *tail = src->head;
+    while (tail->next != NULL) tail = tail->next;
+    tail->next = dest->head;
+    dest->head = src->head;
+    dest->allocated += src->allocated;
+    dest->used += src->used;
+    src->head = NULL;
+    src->allocated = 0;
+    src->used = 0;
+}
+
+/*
+Makes all memory of the arena reusable while keeping its most recent block
+*/
+static void arena_reset(Arena *arena) {
+    if (arena->head == NULL) return;
+    ArenaBlock *keep = arena->head;
+    arena->head = keep->next;
+    arena->allocated -= keep->capacity;
+    arena_release(arena);
+    keep->next = NULL;
+    keep->used = 0;
+    arena->head = keep;
+    arena->allocated = keep->capacity;
+    arena->used = 0;
+}
+
+static void* grow_column(void *column, size_t element_size, int capacity) {
+    void *temp = check_allocation(realloc(column, element_size * capacity));
+    stats_add(&run_stats.allocations, 1);
+    return temp;
+}
+
+/*
+Makes room for at least capacity rows in every column, existing rows are kept
+*/
+static void store_reserve(StudentStore *store, int capacity) {
+    if (capacity <= store->capacity) return;
+    if (capacity < INITIAL_MALLOC) capacity = INITIAL_MALLOC;
+    store->birth_date = (int *) grow_column(store->birth_date, sizeof(int), capacity);
+    store->gpa = (short *) grow_column(store->gpa, sizeof(short), capacity);
+    store->status = (short *) grow_column(store->status, sizeof(short), capacity);
+    store->type = (unsigned char *) grow_column(store->type, sizeof(unsigned char), capacity);
+    store->name_key = (char **) grow_column(store->name_key, sizeof(char *), capacity);
+    store->text = (char **) grow_column(store->text, sizeof(char *), capacity);
+    store->text_length = (int *) grow_column(store->text_length, sizeof(int), capacity);
+    store->capacity = capacity;
+}
+
+/*
+Bytes of column storage per row, used to account the store against a memory budget
+*/
+static size_t store_row_size(void) {
+    return sizeof(int) + 2 * sizeof(short) + sizeof(unsigned char) + 2 * sizeof(char *) + sizeof(int);
+}
+
+/*
+Copies row src over row dst, the strings are shared
+*/
+static void store_move(StudentStore *store, int dst, int src) {
+    store->birth_date[dst] = store->birth_date[src];
+    store->gpa[dst] = store->gpa[src];
+    store->status[dst] = store->status[src];
+    store->type[dst] = store->type[src];
+    store->name_key[dst] = store->name_key[src];
+    store->text[dst] = store->text[src];
+    store->text_length[dst] = store->text_length[src];
+}
+
+/*
+Frees the columns, the strings belong to the arena they came from
+*/
+static void store_free(StudentStore *store) {
+    free(store->birth_date);
+    free(store->gpa);
+    free(store->status);
+    free(store->type);
+    free(store->name_key);
+    free(store->text);
+    free(store->text_length);
+    memset(store, 0, sizeof(StudentStore));
+}
+
+static void line_reader_init(LineReader *reader, FILE *fp) {
+    memset(reader, 0, sizeof(LineReader));
+    reader->fp = fp;
+    reader->capacity = READ_CHUNK_SIZE;
+    reader->buffer = (char *) check_allocation(malloc(reader->capacity));
+}
+
+/*
+Returns the next line without its newline, null terminated, and its length
+The line lives in the reader's buffer and is only valid until the next call
+Returns NULL at the end of the input, a last line without a newline is still returned
+*/
+static char* line_reader_next(LineReader *reader, size_t *length) {
     while (1) {
-        if (*line_count >= current_capacity) {
-            current_capacity *= 2;
-            char **temp = realloc(lines, sizeof(char *) * current_capacity);
-            if (temp == NULL) {
-                free(lines);
-                perror("Failed to allocate.");
-                exit(EXIT_FAILURE);
-            }
-            lines = temp;
+        char *line = reader->buffer + reader->start;
+        char *newline = memchr(line, '\n', reader->end - reader->start);
+        if (newline != NULL) {
+            *newline = '\0';
+            *length = newline - line;
+            reader->start += *length + 1;
+            return line;
         }
-
-        int position = ftell(input_fp);
-        if (position == -1) {
-            perror("ftell failed.");
-            break;
+        if (reader->eof) {
+            if (reader->start == reader->end) return NULL;
+            // One byte is always kept free past the data for this terminator
+            reader->buffer[reader->end] = '\0';
+            *length = reader->end - reader->start;
+            reader->start = reader->end;
+            return line;
         }
-        
-        int line_size = 0;
-        char c;
-        while ((c = fgetc(input_fp)) != '\n' && c != EOF) {
-            line_size++;
+
+        // Move the partial line to the front, then grow the buffer if the line fills it
+        size_t pending = reader->end - reader->start;
+        memmove(reader->buffer, line, pending);
+        reader->start = 0;
+        reader->end = pending;
+        if (reader->capacity - reader->end <= 1) {
+            reader->capacity *= 2;
+            reader->buffer = check_allocation(realloc(reader->buffer, reader->capacity));
         }
-        // Accounts for new line and null terminator
-        line_size += 2;
+        size_t read = fread(reader->buffer + reader->end, 1, reader->capacity - reader->end - 1, reader->fp);
+        if (read == 0) reader->eof = 1;
+        reader->end += read;
+        reader->bytes_read += read;
+    }
+}
 
-        if (line_size <= 2) return lines;
+static void line_reader_free(LineReader *reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
 
-        // Moves pointer back after counting size
-        fseek(input_fp, position, SEEK_SET);
+/*
+Takes fp and line array pointer and loads the input line by line to an array
+Works on any stream, nothing is measured or seeked, so pipes and stdin are fine
+Must manage realloction as the input size is variable
+Also keep track of line_count and the bytes read
+Returns pointer to string array
+No format error handling
+Line buffers come from the arena
+*/
+static char** read_lines(FILE *input_fp, int *line_count, size_t *bytes_read, Arena *arena) {
+    int current_capacity = INITIAL_MALLOC;
+    char **lines = (char **) check_allocation(malloc(sizeof(char *) * INITIAL_MALLOC));
 
-        char *line = (char *) malloc(sizeof(char) * line_size);
-        if (line == NULL) {
-            perror("Failed to allocate.");
-            exit(EXIT_FAILURE);
-        }
-        if (fgets(line, line_size, input_fp) == NULL) {
-            free(line);
+    LineReader reader;
+    line_reader_init(&reader, input_fp);
+    char *line;
+    size_t length;
+    while ((line = line_reader_next(&reader, &length)) != NULL) {
+        // Reading stops at the first empty line
+        if (length == 0) break;
 
-            if (feof(input_fp)) {
-                break;
-            }
-            continue;
+        if (*line_count >= current_capacity) {
+            current_capacity *= 2;
+            lines = check_allocation(realloc(lines, sizeof(char *) * current_capacity));
         }
-        size_t endline = strcspn(line, "\n");
-        line[endline] = '\0';
 
-        lines[*line_count] = line;
+        char *copy = (char *) arena_alloc(arena, length + 1);
+        memcpy(copy, line, length + 1);
+        lines[*line_count] = copy;
         (*line_count)++;
+    }
+    *bytes_read = reader.bytes_read;
+    line_reader_free(&reader);
 
-        if (c == EOF) {
-            break;
+    return lines;
+}
+
+/*
+Maps the whole input file into memory (private, writable so lines can be terminated in place)
+One extra zeroed byte is always reserved past the end so the last line can be terminated
+even when it has no trailing newline and the file size is a multiple of the page size
+Returns 1 on success, 0 if the input can't be mapped (pipes, special files, etc.)
+*/
+static int map_input(FILE *input_fp, MappedInput *mapped) {
+    struct stat st;
+    int fd = fileno(input_fp);
+    if (fd == -1 || fstat(fd, &st) == -1) return 0;
+    if (!S_ISREG(st.st_mode) || st.st_size <= 0) return 0;
+
+    size_t size = (size_t) st.st_size;
+    size_t mapped_size = size + 1;
+
+    // Reserve size + 1 zeroed bytes, then place the file over the start of the reservation
+    char *base = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return 0;
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, mapped_size);
+        return 0;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    mapped->data = base;
+    mapped->size = size;
+    mapped->mapped_size = mapped_size;
+    return 1;
+}
+
+static void unmap_input(MappedInput *mapped) {
+    if (mapped->data != NULL) munmap(mapped->data, mapped->mapped_size);
+    mapped->data = NULL;
+}
+
+/*
+Finds the line boundaries inside a mapped input and terminates each line in place
+Returns pointer array of views into the mapping, no line is copied or allocated
+Same semantics as read_lines(): reading stops at the first empty line
+*/
+static char** split_mapped_lines(MappedInput *mapped, int *line_count) {
+    int current_capacity = INITIAL_MALLOC;
+    char **lines = (char **) check_allocation(malloc(sizeof(char *) * INITIAL_MALLOC));
+
+    char *cursor = mapped->data;
+    char *end = mapped->data + mapped->size;
+    while (cursor < end) {
+        char *newline = memchr(cursor, '\n', end - cursor);
+        char *line_end = newline != NULL ? newline : end;
+        if (line_end == cursor) break;
+
+        if (*line_count >= current_capacity) {
+            current_capacity *= 2;
+            lines = check_allocation(realloc(lines, sizeof(char *) * current_capacity));
         }
+
+        *line_end = '\0';
+        lines[*line_count] = cursor;
+        (*line_count)++;
+
+        if (newline == NULL) break;
+        cursor = newline + 1;
     }
 
     return lines;
@@ -117,7 +886,7 @@ Ex. "Jan" => 1, "Feb" => 2, etc.
 
 EXIT_FAILURE if invalid month
 */
-int month_to_int(char month[]) {
+static int month_to_int(char month[]) {
     char months[][4] = {
         "Jan", "Feb", "Mar", "Apr", "May", "Jun", 
         "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
@@ -131,18 +900,26 @@ int month_to_int(char month[]) {
     return -1;
 }
 
-int days_per_month(int month) {
+static int days_per_month(int month) {
     int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
     
     return days[month - 1];
 }
 
+// --emit outputs of the command line opened so far, global so every output_error() reaches them
+static FILE *emit_fps[3];
+static int emit_fp_count = 0;
+
 /*
 Pass in the output fp and a string literal to be written to output file
+The line also goes to every --emit output, so none of them is left looking like an empty result
 */
-void output_error(FILE *output_fp, char error[]) {
+static void output_error(FILE *output_fp, const char *error) {
 
     fprintf(output_fp, "ERROR: %s\n", error);
+    for (int i = 0; i < emit_fp_count; i++) {
+        if (emit_fps[i] != output_fp) fprintf(emit_fps[i], "ERROR: %s\n", error);
+    }
     exit(EXIT_FAILURE);
 }
 
@@ -150,7 +927,7 @@ void output_error(FILE *output_fp, char error[]) {
 Checks if the date exists in the real calendar, including leap year considerations
 Assumes month, day [1-31], and year are valid on their own
 */
-int valid_date(char *month, int day, int year) {
+static int valid_date(char *month, int day, int year) {
     int month_num = month_to_int(month);
     int day_amount = days_per_month(month_num);
     if (month_num == 2 && year % 4 == 0) return day <= 29; // Check leap year
@@ -158,13 +935,114 @@ int valid_date(char *month, int day, int year) {
     return 1;
 }
 
+static void to_lower_case(char* str) {
+    int i = 0;
+    while (str[i] != '\0') {
+        if (str[i] >= 'A' && str[i] <= 'Z') {
+            str[i] = str[i] + 32;
+        }
+        i++;
+    }
+}
+
 /*
-Takes lines and returns a pointer to a student array (unsorted)
-Also takes output fp to handle errors by calling output_error()
+Returns the lower case "last\0first\0" name key of the ordering
+*/
+static char* name_key_copy(Arena *arena, const char *last_name, const char *first_name) {
+    size_t last_length = strlen(last_name) + 1;
+    size_t first_length = strlen(first_name) + 1;
+    char *key = (char *) arena_alloc(arena, last_length + first_length);
+    memcpy(key, last_name, last_length);
+    memcpy(key + last_length, first_name, first_length);
+    to_lower_case(key);
+    to_lower_case(key + last_length);
+    return key;
+}
+
+/*
+Converts an already validated GPA string to thousandths
+Ex. "3.5" => 3500, "04.25" => 4250, ".7" => 700
+*/
+static int gpa_to_fixed(char *gpa_str) {
+    int whole = 0;
+    int fraction = 0;
+    int scale = 100;
+    int i = 0;
+    while (gpa_str[i] != '\0' && gpa_str[i] != '.') {
+        whole = whole * 10 + (gpa_str[i] - '0');
+        i++;
+    }
+    if (gpa_str[i] == '.') i++;
+    while (gpa_str[i] != '\0' && scale > 0) {
+        fraction += (gpa_str[i] - '0') * scale;
+        scale /= 10;
+        i++;
+    }
+    return whole * 1000 + fraction;
+}
+
+/*
+Returns 1 if a validated student passes the filter, NULL passes everyone
+*/
+static int filter_accepts(const RecordFilter *filter, int year, int gpa, int status) {
+    if (filter == NULL || !filter->active) return 1;
+    return gpa >= filter->min_gpa && year >= filter->min_year && year <= filter->max_year &&
+           status >= filter->min_toefl;
+}
+
+/*
+Stores the student from validated fields in row index of store
+The record text holds every field in output order, each ended by a null byte
+When the fields already sit back to back in the line (a canonical line after tokenizing) the text
+is that span of the line: a view when zero_copy is set, otherwise one copy into the arena
+Any other layout is assembled field by field into the arena
 */
-Student parse_line(char *line, FILE *output_fp) {
-    Student student;
+static void build_student(const RecordFields *fields, StudentStore *store, int index, Arena *arena, int zero_copy) {
+    // Precomputes the ordering key
+    store->birth_date[index] = fields->birth_date;
+    store->gpa[index] = (short) fields->gpa;
+    store->status[index] = (short) fields->status;
+    store->type[index] = (unsigned char) fields->type;
+    store->name_key[index] = name_key_copy(arena, fields->last_name, fields->first_name);
+
+    char *parts[RECORD_FIELDS] = {fields->first_name, fields->last_name, fields->birth_month, fields->birth_day,
+                                  fields->birth_year, fields->gpa_str, fields->type_token, fields->TOEFL_score};
+    int part_count = fields->type == INTERNATIONAL ? RECORD_FIELDS : RECORD_FIELDS - 1;
+    int offsets[RECORD_FIELDS];
+    size_t lengths[RECORD_FIELDS];
+    int contiguous = 1;
+    int text_size = 0;
+    for (int i = 0; i < part_count; i++) {
+        lengths[i] = strlen(parts[i]);
+        if (parts[i] != fields->first_name + text_size) contiguous = 0;
+        offsets[i] = text_size;
+        text_size += (int) lengths[i] + 1;
+    }
+
+    char *text;
+    if (contiguous && zero_copy) {
+        text = fields->first_name;
+    } else if (contiguous) {
+        text = (char *) arena_alloc(arena, text_size);
+        memcpy(text, fields->first_name, text_size);
+    } else {
+        text = (char *) arena_alloc(arena, text_size);
+        for (int i = 0; i < part_count; i++) {
+            memcpy(text + offsets[i], parts[i], lengths[i] + 1);
+        }
+    }
+    store->text[index] = text;
+    store->text_length[index] = text_size - 1;
+}
 
+/*
+Validates one line into row index of store, the reference implementation of every format rule
+Returns NULL on success, RECORD_FILTERED if the line is valid but filter rejects it (nothing is
+stored), otherwise the message to report with output_error()
+Reentrant, all tokenizing state lives on the stack so lines can be parsed on several threads
+*/
+static const char* parse_record_scalar(char *line, StudentStore *store, int index, Arena *arena, int zero_copy,
+                                const RecordFilter *filter) {
     char *first_name;
     char *last_name;
     char *gpa_str;
@@ -172,7 +1050,7 @@ Student parse_line(char *line, FILE *output_fp) {
     char *type;
 
     char *TOEFL_score_str;
-    int TOEFL_score;
+    int TOEFL_score = -1;
     
     char *month;
     char *day_str;
@@ -181,407 +1059,2814 @@ Student parse_line(char *line, FILE *output_fp) {
     int year;
 
     char delimiter[] = " ";
+    char *save;
 
-    first_name = strtok(line, delimiter); // Handles first_name
-    if (!first_name) output_error(output_fp, "Invalid first name");
+    first_name = strtok_r(line, delimiter, &save); // Handles first_name
+    if (!first_name) return "Invalid first name";
 
-    last_name = strtok(NULL, delimiter); // Handles last_name
-    if (!last_name) output_error(output_fp, "Invalid last name");
+    last_name = strtok_r(NULL, delimiter, &save); // Handles last_name
+    if (!last_name) return "Invalid last name";
 
     char date_delim[] = "-";
-    date = strtok(NULL, delimiter);
+    date = strtok_r(NULL, delimiter, &save);
     if (date) {
-        for (int i = 0; i < strlen(date); i++)
-            if (date[i] == '.') output_error(output_fp, "Date cannot contain a float");
+        size_t date_length = strlen(date);
+        for (size_t i = 0; i < date_length; i++)
+            if (date[i] == '.') return "Date cannot contain a float";
             
         month = strtok_r(date, date_delim, &date); // Handles month
-        if (!month || month_to_int(month) == -1) output_error(output_fp, "Invalid month");
+        if (!month || month_to_int(month) == -1) return "Invalid month";
 
         day_str = strtok_r(date, date_delim, &date); // Handles day
         if (day_str) {
             day = atoi(day_str);
-            if (day > 31 || day < 1) output_error(output_fp, "Invalid day");
+            if (day > 31 || day < 1) return "Invalid day";
             int i = 0;
             while (day_str[i] != '\0') {
-                if (day_str[i] < '0' || day_str[i] > '9') output_error(output_fp, "Day must be an integer");
+                if (day_str[i] < '0' || day_str[i] > '9') return "Day must be an integer";
                 i++;
             }
-        } else output_error(output_fp, "Invalid day");
+        } else return "Invalid day";
 
         year_str = strtok_r(date, delimiter, &date); // Handles year
         if (year_str) {
             year = atoi(year_str);
-            if (year < 1950 || year > 2010) output_error(output_fp, "Year must be between 1950 and 2010 (inclusive)");
+            if (year < 1950 || year > 2010) return "Year must be between 1950 and 2010 (inclusive)";
             int i = 0;
             while (year_str[i] != '\0') {
-                if (year_str[i] < '0' || year_str[i] > '9') output_error(output_fp, "Year must be an integer");
+                if (year_str[i] < '0' || year_str[i] > '9') return "Year must be an integer";
                 i++;
             }
-        } else output_error(output_fp, "Invalid year");
+        } else return "Invalid year";
 
         // Checks if date is valid
-        if (!valid_date(month, day, year)) output_error(output_fp, "Invalid date");
+        if (!valid_date(month, day, year)) return "Invalid date";
         
-    } else output_error(output_fp, "Invalid date");
+    } else return "Invalid date";
 
-    gpa_str = strtok(NULL, delimiter); // Handles gpa
+    gpa_str = strtok_r(NULL, delimiter, &save); // Handles gpa
     if (gpa_str) {
         int dec_count = 0;
-        for (int i = 0; i < strlen(gpa_str); i++) {
-            if (gpa_str[i] != '.' && (gpa_str[i] < '0' || gpa_str[i] > '9')) output_error(output_fp, "GPA must be a float");
+        size_t gpa_length = strlen(gpa_str);
+        for (size_t i = 0; i < gpa_length; i++) {
+            if (gpa_str[i] != '.' && (gpa_str[i] < '0' || gpa_str[i] > '9')) return "GPA must be a float";
             if (gpa_str[i] == '.') dec_count++;
-            if (dec_count > 1) output_error(output_fp, "Invalid GPA");
+            if (dec_count > 1) return "Invalid GPA";
         }
         char *dec_place = strchr(gpa_str, '.');
-        if (dec_count > 0 && strlen(gpa_str) - (int) (dec_place - gpa_str) - 1 > 3) output_error(output_fp, "Too many decimal places in GPA");
+        if (dec_count > 0 && gpa_length - (int) (dec_place - gpa_str) - 1 > 3) return "Too many decimal places in GPA";
         float gpa = atof(gpa_str);
         float epsilon = 0.0001f;
-        if (gpa > 4.3f + epsilon || gpa < 0.0f) output_error(output_fp, "GPA must be between 0.0 and 4.3");
-    } else output_error(output_fp, "Invalid GPA");
+        if (gpa > 4.3f + epsilon || gpa < 0.0f) return "GPA must be between 0.0 and 4.3";
+    } else return "Invalid GPA";
 
-    type = strtok(NULL, delimiter); // Handles type
+    type = strtok_r(NULL, delimiter, &save); // Handles type
     if (type) {
-        if (strcmp(type, "I") && strcmp(type, "D")) output_error(output_fp, "Invalid type");
-    } else output_error(output_fp, "Invalid type");
+        if (strcmp(type, "I") && strcmp(type, "D")) return "Invalid type";
+    } else return "Invalid type";
 
-    TOEFL_score_str = strtok(NULL, delimiter); // Handles TOEFL
+    TOEFL_score_str = strtok_r(NULL, delimiter, &save); // Handles TOEFL
     if (TOEFL_score_str) {
         if (strcmp(type, "I") == 0) {
             int i = 0;
             while (TOEFL_score_str[i] != '\0') {
-                if (TOEFL_score_str[i] < '0' || TOEFL_score_str[i] > '9') output_error(output_fp, "TOEFL must be an integer");
+                if (TOEFL_score_str[i] < '0' || TOEFL_score_str[i] > '9') return "TOEFL must be an integer";
                 i++;
             }
             TOEFL_score = atoi(TOEFL_score_str);
-            if (TOEFL_score > 120 || TOEFL_score < 0) output_error(output_fp, "TOEFL must be an int between 0 and 120");
-        } else output_error(output_fp, "Domestic students cannot have a TOEFL");
-    } else if (strcmp(type, "I") == 0) output_error(output_fp, "Missing TOEFL");
-
-    // Generates student
-    if (strcmp(type, "I") == 0) {
-        // Generate international student
-        student.type = INTERNATIONAL;
-        student.student.international.first_name = strdup(first_name);
-        student.student.international.last_name = strdup(last_name);
-        student.student.international.birth_year = strdup(year_str);
-        student.student.international.birth_month = strdup(month);
-        student.student.international.birth_day = strdup(day_str);
-        student.student.international.gpa_str = strdup(gpa_str);
-        student.student.international.TOEFL_score = strdup(TOEFL_score_str);
-    } else {
-        // Generate domestic student
-        student.type = DOMESTIC;
-        student.student.domestic.first_name = strdup(first_name);
-        student.student.domestic.last_name = strdup(last_name);
-        student.student.domestic.birth_year = strdup(year_str);
-        student.student.domestic.birth_month = strdup(month);
-        student.student.domestic.birth_day = strdup(day_str);
-        student.student.domestic.gpa_str = strdup(gpa_str);
-    }
-    return student;
-}
-
-Student* generate_students_from_lines(char **lines, int line_count, int *student_count, FILE *output_fp) {
-    // Allocate memory for students array
-    Student *students = malloc(sizeof(Student) * line_count);
-    if (students == NULL) {
-        perror("Failed to allocate memory.\n");
-        exit(EXIT_FAILURE);
+            if (TOEFL_score > 120 || TOEFL_score < 0) return "TOEFL must be an int between 0 and 120";
+        } else return "Domestic students cannot have a TOEFL";
+    } else if (strcmp(type, "I") == 0) return "Missing TOEFL";
+
+    RecordFields fields;
+    fields.type = strcmp(type, "I") == 0 ? INTERNATIONAL : DOMESTIC;
+    fields.first_name = first_name;
+    fields.last_name = last_name;
+    fields.birth_year = year_str;
+    fields.birth_month = month;
+    fields.birth_day = day_str;
+    fields.gpa_str = gpa_str;
+    fields.type_token = type;
+    fields.TOEFL_score = TOEFL_score_str;
+    fields.birth_date = year * 10000 + month_to_int(month) * 100 + day;
+    fields.gpa = gpa_to_fixed(gpa_str);
+    fields.status = fields.type == INTERNATIONAL ? TOEFL_score : -1;
+    if (!filter_accepts(filter, year, fields.gpa, fields.status)) return RECORD_FILTERED;
+    build_student(&fields, store, index, arena, zero_copy);
+    return NULL;
+}
+
+/*
+Character classes of a line copied into a zero padded LINE_BLOCK byte block
+Scalar version, used when no vector unit is available
+*/
+static void classify_line_scalar(const unsigned char *block, LineMasks *masks) {
+    masks->space = masks->dash = masks->digit = masks->dot = 0;
+    for (int i = 0; i < LINE_BLOCK; i++) {
+        uint64_t bit = (uint64_t) 1 << i;
+        if (block[i] == ' ') masks->space |= bit;
+        if (block[i] == '-') masks->dash |= bit;
+        if (block[i] == '.') masks->dot |= bit;
+        if ((unsigned char) (block[i] - '0') <= 9) masks->digit |= bit;
     }
+}
 
-    for (int i = 0; i < line_count; i++) {
-        // Parse each line and store in the students array
-        students[i] = parse_line(lines[i], output_fp);
-        (*student_count)++;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void classify_line_sse2(const unsigned char *block, LineMasks *masks) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i dash = _mm_set1_epi8('-');
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    masks->space = masks->dash = masks->digit = masks->dot = 0;
+    for (int i = 0; i < LINE_BLOCK; i += 16) {
+        __m128i bytes = _mm_load_si128((const __m128i *) (block + i));
+        __m128i offset = _mm_sub_epi8(bytes, zero);
+        __m128i digit = _mm_cmpeq_epi8(_mm_min_epu8(offset, nine), offset); // Unsigned byte - '0' <= 9
+        masks->space |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, space)) << i;
+        masks->dash |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, dash)) << i;
+        masks->dot |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, dot)) << i;
+        masks->digit |= (uint64_t) (uint16_t) _mm_movemask_epi8(digit) << i;
     }
+}
 
-    return students;
+__attribute__((target("avx2")))
+static void classify_line_avx2(const unsigned char *block, LineMasks *masks) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i dash = _mm256_set1_epi8('-');
+    const __m256i dot = _mm256_set1_epi8('.');
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i nine = _mm256_set1_epi8(9);
+    masks->space = masks->dash = masks->digit = masks->dot = 0;
+    for (int i = 0; i < LINE_BLOCK; i += 32) {
+        __m256i bytes = _mm256_load_si256((const __m256i *) (block + i));
+        __m256i offset = _mm256_sub_epi8(bytes, zero);
+        __m256i digit = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, nine), offset);
+        masks->space |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, space)) << i;
+        masks->dash |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, dash)) << i;
+        masks->dot |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, dot)) << i;
+        masks->digit |= (uint64_t) (uint32_t) _mm256_movemask_epi8(digit) << i;
+    }
 }
+#endif
+
+// Classifier picked by select_line_classifier(), the scalar one until then
+static void (*classify_line)(const unsigned char *block, LineMasks *masks) = classify_line_scalar;
+static const char *line_classifier_name = "scalar";
+static pthread_once_t line_classifier_once = PTHREAD_ONCE_INIT; // Library jobs pick the classifier once per process
 
 /*
-Outputs domestic (option 1)
+Picks the widest classifier the CPU supports, call once before parsing starts
 */
-void output_domestic(FILE *output_fp, Student *students, int student_count) {
-    for (int i = 0; i < student_count; i++) {
-        if (students[i].type == DOMESTIC) {
-            char *first_name = students[i].student.domestic.first_name;
-            char *last_name = students[i].student.domestic.last_name;
-            char *birth_month = students[i].student.domestic.birth_month;
-            char *birth_day = students[i].student.domestic.birth_day;
-            char *birth_year = students[i].student.domestic.birth_year;
-            char *gpa_str = students[i].student.domestic.gpa_str;
-
-            fprintf(output_fp ,"%s %s %s-%s-%s %s D\n", first_name, last_name,
-                birth_month, birth_day, birth_year, gpa_str);
-        }
+static void select_line_classifier(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        classify_line = classify_line_avx2;
+        line_classifier_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        classify_line = classify_line_sse2;
+        line_classifier_name = "sse2";
     }
+#endif
 }
 
 /*
-Outputs international (option 2)
+Returns 1 if count bits starting at start are all set in mask
 */
-void output_international(FILE *output_fp, Student *students, int student_count) {
-    for (int i = 0; i < student_count; i++) {
-        if (students[i].type == INTERNATIONAL) {
-            char *first_name = students[i].student.international.first_name;
-            char *last_name = students[i].student.international.last_name;
-            char *birth_month = students[i].student.international.birth_month;
-            char *birth_day = students[i].student.international.birth_day;
-            char *birth_year = students[i].student.international.birth_year;
-            char *gpa_str = students[i].student.international.gpa_str;
-            char *TOEFL_score = students[i].student.international.TOEFL_score;
+static int mask_covers(uint64_t mask, int start, int count) {
+    uint64_t bits = (((uint64_t) 1 << count) - 1) << start;
+    return (mask & bits) == bits;
+}
 
-            fprintf(output_fp, "%s %s %s-%s-%s %s I %s\n", first_name, last_name,
-                birth_month, birth_day, birth_year, gpa_str, TOEFL_score);
-        }
+/*
+Month number of three bytes, -1 if they aren't a month abbreviation
+*/
+static int month_from_bytes(const unsigned char *bytes) {
+    static const uint32_t packed[] = {
+        'J' | 'a' << 8 | 'n' << 16, 'F' | 'e' << 8 | 'b' << 16, 'M' | 'a' << 8 | 'r' << 16,
+        'A' | 'p' << 8 | 'r' << 16, 'M' | 'a' << 8 | 'y' << 16, 'J' | 'u' << 8 | 'n' << 16,
+        'J' | 'u' << 8 | 'l' << 16, 'A' | 'u' << 8 | 'g' << 16, 'S' | 'e' << 8 | 'p' << 16,
+        'O' | 'c' << 8 | 't' << 16, 'N' | 'o' << 8 | 'v' << 16, 'D' | 'e' << 8 | 'c' << 16};
+    uint32_t value = bytes[0] | bytes[1] << 8 | bytes[2] << 16;
+    for (int i = 0; i < 12; i++) {
+        if (packed[i] == value) return i + 1;
     }
+    return -1;
 }
 
 /*
-Outputs both (option3)
+Fast path for lines in the canonical layout: single spaces, Mon-D-YYYY or Mon-DD-YYYY dates,
+a GPA of one digit with up to 3 decimals and a TOEFL of up to 3 digits
+The whole line is classified with one pass of the vector classifier, then fields are checked
+against the masks and converted with fixed width digit arithmetic
+Returns 1 with row index of store filled in, -1 for a valid line the filter rejects, or 0 without
+touching the line when the line needs the full parse_record_scalar() (any other layout, and every
+invalid line so its error message is exact)
 */
-void output_both(FILE *output_fp, Student *students, int student_count) {
-    for (int i = 0; i < student_count; i++) {
-        if (students[i].type == INTERNATIONAL) {
-            char *first_name = students[i].student.international.first_name;
-            char *last_name = students[i].student.international.last_name;
-            char *birth_month = students[i].student.international.birth_month;
-            char *birth_day = students[i].student.international.birth_day;
-            char *birth_year = students[i].student.international.birth_year;
-            char *gpa_str = students[i].student.international.gpa_str;
-            char *TOEFL_score = students[i].student.international.TOEFL_score;
+static int parse_record_fast(char *line, StudentStore *store, int index, Arena *arena, int zero_copy,
+                      const RecordFilter *filter) {
+    size_t length = strnlen(line, LINE_BLOCK);
+    if (length >= (size_t) LINE_BLOCK) return 0;
+
+    unsigned char block[LINE_BLOCK] __attribute__((aligned(32)));
+    memset(block, 0, LINE_BLOCK);
+    memcpy(block, line, length);
+    LineMasks masks;
+    classify_line(block, &masks);
+
+    // Token boundaries, tokens must be non-empty and separated by exactly one space
+    int separator_count = __builtin_popcountll(masks.space);
+    if (separator_count != 4 && separator_count != 5) return 0;
+    int separators[6];
+    uint64_t spaces = masks.space;
+    for (int i = 0; i < separator_count; i++) {
+        separators[i] = __builtin_ctzll(spaces);
+        spaces &= spaces - 1;
+    }
+    separators[separator_count] = (int) length;
+    if (separators[0] == 0) return 0;
+    for (int i = 0; i < separator_count; i++) {
+        if (separators[i + 1] - separators[i] < 2) return 0;
+    }
 
-            fprintf(output_fp, "%s %s %s-%s-%s %s I %s\n", first_name, last_name,
-                birth_month, birth_day, birth_year, gpa_str, TOEFL_score);
-        }
-        if (students[i].type == DOMESTIC) {
-            char *first_name = students[i].student.domestic.first_name;
-            char *last_name = students[i].student.domestic.last_name;
-            char *birth_month = students[i].student.domestic.birth_month;
-            char *birth_day = students[i].student.domestic.birth_day;
-            char *birth_year = students[i].student.domestic.birth_year;
-            char *gpa_str = students[i].student.domestic.gpa_str;
+    // Type
+    int type_start = separators[3] + 1;
+    if (separators[4] - type_start != 1) return 0;
+    StudentType type;
+    if (block[type_start] == 'D' && separator_count == 4) {
+        type = DOMESTIC;
+    } else if (block[type_start] == 'I' && separator_count == 5) {
+        type = INTERNATIONAL;
+    } else {
+        return 0;
+    }
 
-            fprintf(output_fp ,"%s %s %s-%s-%s %s D\n", first_name, last_name,
-                birth_month, birth_day, birth_year, gpa_str);
+    // Date, Mon-D-YYYY or Mon-DD-YYYY with dashes only in the two expected places
+    int date_start = separators[1] + 1;
+    int day_length = separators[2] - date_start - 9;
+    if (day_length != 1 && day_length != 2) return 0;
+    int year_start = separators[2] - 4;
+    uint64_t date_bits = (((uint64_t) 1 << (separators[2] - date_start)) - 1) << date_start;
+    uint64_t expected_dashes = ((uint64_t) 1 << (date_start + 3)) | ((uint64_t) 1 << (year_start - 1));
+    if ((masks.dash & date_bits) != expected_dashes) return 0;
+    if (!mask_covers(masks.digit, date_start + 4, day_length) || !mask_covers(masks.digit, year_start, 4)) return 0;
+
+    int month = month_from_bytes(block + date_start);
+    const unsigned char *d = block + date_start + 4;
+    int day = day_length == 1 ? d[0] - '0' : (d[0] - '0') * 10 + (d[1] - '0');
+    const unsigned char *y = block + year_start;
+    int year = (y[0] - '0') * 1000 + (y[1] - '0') * 100 + (y[2] - '0') * 10 + (y[3] - '0');
+    if (month == -1 || day < 1 || year < 1950 || year > 2010) return 0;
+    int month_days = month == 2 && year % 4 == 0 ? 29 : days_per_month(month);
+    if (day > month_days) return 0;
+
+    // GPA, D or D. followed by up to 3 digits
+    int gpa_start = separators[2] + 1;
+    int gpa_length = separators[3] - gpa_start;
+    if (gpa_length > 5 || !mask_covers(masks.digit, gpa_start, 1)) return 0;
+    if (gpa_length > 1 && (!mask_covers(masks.dot, gpa_start + 1, 1) || !mask_covers(masks.digit, gpa_start + 2, gpa_length - 2))) return 0;
+    const unsigned char *g = block + gpa_start;
+    int gpa = (g[0] - '0') * 1000;
+    if (gpa_length > 2) gpa += (g[2] - '0') * 100;
+    if (gpa_length > 3) gpa += (g[3] - '0') * 10;
+    if (gpa_length > 4) gpa += g[4] - '0';
+    if (gpa > 4300) return 0;
+
+    // TOEFL, up to 3 digits
+    int status = -1;
+    if (type == INTERNATIONAL) {
+        int toefl_start = separators[4] + 1;
+        int toefl_length = (int) length - toefl_start;
+        if (toefl_length > 3 || !mask_covers(masks.digit, toefl_start, toefl_length)) return 0;
+        status = 0;
+        for (int i = 0; i < toefl_length; i++) {
+            status = status * 10 + (block[toefl_start + i] - '0');
         }
+        if (status > 120) return 0;
     }
-}
 
-void to_lower_case(char* str) {
-    int i = 0;
-    while (str[i] != '\0') {
-        if (str[i] >= 'A' && str[i] <= 'Z') {
-            str[i] = str[i] + 32;
+    if (!filter_accepts(filter, year, gpa, status)) return -1;
+
+    // Terminate the fields in place, exactly where strtok would have
+    for (int i = 0; i < separator_count; i++) {
+        line[separators[i]] = '\0';
+    }
+    line[date_start + 3] = '\0';
+    line[year_start - 1] = '\0';
+
+    RecordFields fields;
+    fields.type = type;
+    fields.first_name = line;
+    fields.last_name = line + separators[0] + 1;
+    fields.birth_month = line + date_start;
+    fields.birth_day = line + date_start + 4;
+    fields.birth_year = line + year_start;
+    fields.gpa_str = line + gpa_start;
+    fields.type_token = line + type_start;
+    fields.TOEFL_score = type == INTERNATIONAL ? line + separators[4] + 1 : NULL;
+    fields.birth_date = year * 10000 + month * 100 + day;
+    fields.gpa = gpa;
+    fields.status = status;
+    build_student(&fields, store, index, arena, zero_copy);
+    return 1;
+}
+
+/*
+Validates one line into row index of store
+Canonical lines take the vectorized fast path, everything else the full scalar validation
+Returns NULL on success, RECORD_FILTERED if filter rejects the student, otherwise the message to
+report with output_error()
+*/
+static const char* parse_record(char *line, StudentStore *store, int index, Arena *arena, int zero_copy,
+                         const RecordFilter *filter) {
+    int fast = parse_record_fast(line, store, index, arena, zero_copy, filter);
+    if (fast == 1) return NULL;
+    if (fast == -1) return RECORD_FILTERED;
+    return parse_record_scalar(line, store, index, arena, zero_copy, filter);
+}
+
+/*
+Takes a line and stores the parsed student in row index of store
+Also takes output fp to handle errors by calling output_error()
+*/
+static void parse_line(char *line, StudentStore *store, int index, FILE *output_fp, Arena *arena, int zero_copy) {
+    const char *error = parse_record(line, store, index, arena, zero_copy, NULL);
+    if (error != NULL) output_error(output_fp, error);
+}
+
+static void error_log_add(ErrorLog *log, int line, const char *message) {
+    if (log->count >= log->capacity) {
+        log->capacity = log->capacity == 0 ? INITIAL_MALLOC : log->capacity * 2;
+        log->errors = check_allocation(realloc(log->errors, sizeof(LineError) * log->capacity));
+    }
+    log->errors[log->count].line = line;
+    log->errors[log->count].message = message;
+    log->errors[log->count].source = NULL;
+    log->count++;
+}
+
+/*
+Moves every error of src to the end of dest, src is left empty
+*/
+static void error_log_append(ErrorLog *dest, ErrorLog *src) {
+    for (int i = 0; i < src->count; i++) {
+        error_log_add(dest, src->errors[i].line, src->errors[i].message);
+        dest->errors[dest->count - 1].source = src->errors[i].source;
+    }
+    free(src->errors);
+    src->errors = NULL;
+    src->count = src->capacity = 0;
+}
+
+static void error_log_free(ErrorLog *log) {
+    free(log->errors);
+    log->errors = NULL;
+    log->count = log->capacity = 0;
+}
+
+/*
+Writes one line per error, in line order
+Errors from one of several input files name the file before the line
+*/
+static void write_error_report(FILE *fp, const ErrorLog *log) {
+    for (int i = 0; i < log->count; i++) {
+        if (log->errors[i].source != NULL) {
+            fprintf(fp, "ERROR: %s: line %d: %s\n", log->errors[i].source, log->errors[i].line,
+                    log->errors[i].message);
+        } else {
+            fprintf(fp, "ERROR: line %d: %s\n", log->errors[i].line, log->errors[i].message);
+        }
+    }
+}
+
+static void* parse_chunk_task(void *arg) {
+    ParseChunk *chunk = (ParseChunk *) arg;
+    for (int i = chunk->start; i < chunk->end; i++) {
+        const char *error = parse_record(chunk->lines[i], chunk->store, chunk->first_row + i, &chunk->arena,
+                                         chunk->zero_copy, chunk->filter);
+        if (error == RECORD_FILTERED) {
+            chunk->store->text[chunk->first_row + i] = NULL; // Dropped with the bad lines
+        } else if (error != NULL) {
+            error_log_add(&chunk->errors, i + 1, error);
+            if (chunk->stop_on_error) break;
+        } else if (chunk->aggregates != NULL) {
+            aggregate_student(chunk->aggregates, chunk->store, chunk->first_row + i);
+        }
+    }
+    return NULL;
+}
+
+/*
+Parses every line into new rows after the students already in store (unsorted)
+Line i goes to row store->count + i until bad lines are removed
+With threads > 1 the lines are split into contiguous chunks, each parsed by a worker into its
+own rows of the store with its own arena, which is handed to arena afterwards. There are at most
+threads chunks, one per PARALLEL_PARSE_THRESHOLD lines and one per online CPU
+Every bad line is added to errors in line order and left out of the store
+In ON_ERROR_EXIT mode each chunk stops at its first bad line, so the rows after it are never
+written. Only the students before the first bad line are kept and only its error is added
+Unless aggregates is NULL every stored student is also counted in it, each chunk counts its own
+students while it parses them and the counts are added up after the join
+*/
+static void generate_students_from_lines(char **lines, int line_count, StudentStore *store, Arena *arena,
+                                  RunOptions *options, ErrorLog *errors, Aggregates *aggregates) {
+    int first_row = store->count;
+    store_reserve(store, first_row + line_count);
+
+    // Every chunk gets at least PARALLEL_PARSE_THRESHOLD lines and a CPU of its own
+    int chunk_count = line_count / PARALLEL_PARSE_THRESHOLD;
+    if (chunk_count > options->threads) chunk_count = options->threads;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0 && chunk_count > cpus) chunk_count = (int) cpus;
+    if (chunk_count < 1) chunk_count = 1;
+    ParseChunk *chunks = (ParseChunk *) check_allocation(calloc(chunk_count, sizeof(ParseChunk)));
+    pthread_t *workers = (pthread_t *) check_allocation(malloc(sizeof(pthread_t) * chunk_count));
+    int *started = (int *) check_allocation(calloc(chunk_count, sizeof(int)));
+
+    for (int c = 0; c < chunk_count; c++) {
+        chunks[c].lines = lines;
+        chunks[c].store = store;
+        chunks[c].first_row = first_row;
+        chunks[c].start = (int) ((long long) line_count * c / chunk_count);
+        chunks[c].end = (int) ((long long) line_count * (c + 1) / chunk_count);
+        chunks[c].zero_copy = options->zero_copy;
+        chunks[c].filter = &options->filter;
+        chunks[c].stop_on_error = options->error_mode == ON_ERROR_EXIT;
+        if (aggregates != NULL) {
+            chunks[c].aggregates = (Aggregates *) check_allocation(calloc(1, sizeof(Aggregates)));
+        }
+        // The first chunk runs on this thread, as do chunks whose thread can't be started
+        if (c > 0) started[c] = pthread_create(&workers[c], NULL, parse_chunk_task, &chunks[c]) == 0;
+    }
+    for (int c = 0; c < chunk_count; c++) {
+        if (!started[c]) parse_chunk_task(&chunks[c]);
+    }
+
+    int first_error = errors->count;
+    for (int c = 0; c < chunk_count; c++) {
+        if (started[c]) pthread_join(workers[c], NULL);
+        arena_absorb(arena, &chunks[c].arena);
+        error_log_append(errors, &chunks[c].errors);
+        if (aggregates != NULL) aggregate_merge(aggregates, chunks[c].aggregates);
+        free(chunks[c].aggregates);
+    }
+    free(chunks);
+    free(workers);
+    free(started);
+
+    // The first error added is the bad line with the lowest line number, later chunks' errors go
+    int kept_lines = line_count;
+    if (options->error_mode == ON_ERROR_EXIT && errors->count > first_error) {
+        kept_lines = errors->errors[first_error].line - 1;
+        errors->count = first_error + 1;
+    }
+
+    // Close the gaps left by bad lines
+    int kept = first_row;
+    int next_error = first_error;
+    for (int i = 0; i < kept_lines; i++) {
+        if (next_error < errors->count && errors->errors[next_error].line == i + 1) {
+            next_error++;
+            continue;
+        }
+        if (store->text[first_row + i] == NULL) continue;
+        if (kept != first_row + i) store_move(store, kept, first_row + i);
+        kept++;
+    }
+
+    store->count = kept;
+}
+
+/*
+Starts buffered output on fp, anything fp still buffers is written first
+*/
+static void writer_init(OutputWriter *writer, FILE *fp) {
+    fflush(fp);
+    writer->fd = fileno(fp);
+    writer->used = 0;
+    writer->failed = 0;
+    writer->buffer = (char *) check_allocation(malloc(OUTPUT_BUFFER_SIZE));
+}
+
+/*
+Returns 0 if the data could not be written
+*/
+static int write_all(int fd, const char *data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = write(fd, data + written, size - written);
+        if (result < 0) return 0;
+        written += (size_t) result;
+    }
+    return 1;
+}
+
+static void writer_flush(OutputWriter *writer) {
+    if (!writer->failed && !write_all(writer->fd, writer->buffer, writer->used)) writer->failed = 1;
+    writer->used = 0;
+}
+
+/*
+Flushes and frees the writer, returns 0 if any of its output could not be written
+*/
+static int writer_finish(OutputWriter *writer) {
+    writer_flush(writer);
+    free(writer->buffer);
+    writer->buffer = NULL;
+    return !writer->failed;
+}
+
+/*
+Ends the program when an output could not be written, for the command line paths
+*/
+static void exit_on_write_error(int written) {
+    if (!written) {
+        perror("Failed to write output.");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+Copies a record text to dest as one output line: the null separators become ' ', or '-'
+between the date parts, and a newline is added
+*/
+static void format_record(char *dest, const char *text, size_t length) {
+    memcpy(dest, text, length);
+    dest[length] = '\n';
+    char *end = dest + length;
+    char *separator = memchr(dest, '\0', length);
+    for (int count = 0; separator != NULL; count++) {
+        *separator = count == 2 || count == 3 ? '-' : ' ';
+        separator = memchr(separator + 1, '\0', end - separator - 1);
+    }
+}
+
+/*
+Writes one student in the input format
+*/
+static void output_text(OutputWriter *writer, const char *text, int text_length) {
+    size_t size = (size_t) text_length + 1;
+    if (OUTPUT_BUFFER_SIZE - writer->used < size) writer_flush(writer);
+
+    if (size > OUTPUT_BUFFER_SIZE) {
+        // Only a record longer than the whole buffer gets here, it is written by itself
+        char *line = (char *) check_allocation(malloc(size));
+        format_record(line, text, size - 1);
+        if (!writer->failed && !write_all(writer->fd, line, size)) writer->failed = 1;
+        free(line);
+        return;
+    }
+
+    format_record(writer->buffer + writer->used, text, size - 1);
+    writer->used += size;
+}
+
+static void output_student(OutputWriter *writer, const StudentStore *store, int index) {
+    output_text(writer, store->text[index], store->text_length[index]);
+}
+
+/*
+Returns 1 if a student of this type belongs in the output of option 1, 2 or 3
+*/
+static int option_includes(int option, StudentType type) {
+    if (option == 1) return type == DOMESTIC;
+    if (option == 2) return type == INTERNATIONAL;
+    return 1;
+}
+
+/*
+Writes the students listed in order, callers pick the list for option 1, 2 or 3
+Returns 0 if the output could not be written
+*/
+static int output_students(FILE *output_fp, const StudentStore *store, const int *order, int student_count) {
+    OutputWriter writer;
+    writer_init(&writer, output_fp);
+    for (int i = 0; i < student_count; i++) {
+        output_student(&writer, store, order[i]);
+    }
+    return writer_finish(&writer);
+}
+
+/*
+Compares row a of a_store with row b of b_store
+Returns 1 if student a is less than student b
+Returns -1 if student b is less than student a
+Returns 0 if student a is equal to student b
+Order: birth year, month, day, last name, first name (case insensitive), GPA, then
+domestic before international and finally TOEFL score
+*/
+static int compare_rows(const StudentStore *a_store, int a, const StudentStore *b_store, int b) {
+    int a_date = a_store->birth_date[a];
+    int b_date = b_store->birth_date[b];
+    if (a_date != b_date) return a_date > b_date ? 1 : -1;
+
+    // Name keys are "last\0first\0": equal last names end at the same offset
+    const char *a_name = a_store->name_key[a];
+    const char *b_name = b_store->name_key[b];
+    int cmp = strcmp(a_name, b_name);
+    if (cmp != 0) return cmp > 0 ? 1 : -1;
+
+    size_t first_offset = strlen(a_name) + 1;
+    cmp = strcmp(a_name + first_offset, b_name + first_offset);
+    if (cmp != 0) return cmp > 0 ? 1 : -1;
+
+    if (a_store->gpa[a] != b_store->gpa[b]) return a_store->gpa[a] > b_store->gpa[b] ? 1 : -1;
+
+    if (a_store->status[a] != b_store->status[b]) return a_store->status[a] > b_store->status[b] ? 1 : -1;
+    return 0;
+}
+
+/*
+Same as compare_rows() for two rows of one store
+*/
+static int student_comparator(const StudentStore *store, int a, int b) {
+    return compare_rows(store, a, store, b);
+}
+
+/*
+Merges the sorted index ranges [start, mid] and [mid + 1, end] of order
+Only the left range is copied out to scratch, so nothing is allocated per merge
+*/
+static void merge(const StudentStore *store, int *order, int *scratch, int start, int mid, int end) {
+    int n1 = mid - start + 1;
+    memcpy(scratch + start, order + start, n1 * sizeof(int));
+
+    int *left = scratch + start;
+    int i = 0, j = mid + 1, k = start;
+    while (i < n1 && j <= end) {
+        if (student_comparator(store, left[i], order[j]) <= 0) {
+            order[k++] = left[i++];
+        } else {
+            order[k++] = order[j++];
+        }
+    }
+    // Every comparison placed exactly one index
+    stats_add(&run_stats.comparisons, k - start);
+
+    // Whatever is left of the right range is already in place
+    while (i < n1) {
+        order[k++] = left[i++];
+    }
+}
+
+/*
+Sorts the student indexes in order[start..end], students themselves never move
+scratch must be at least as long as order
+*/
+static void merge_sort(const StudentStore *store, int *order, int *scratch, int start, int end) {
+    if (start < end) {
+        int mid = start + (end - start) / 2;
+        merge_sort(store, order, scratch, start, mid);
+        merge_sort(store, order, scratch, mid + 1, end);
+        merge(store, order, scratch, start, mid, end);
+    }
+}
+
+static void* parallel_merge_sort_task(void *arg);
+
+/*
+Sorts one range, forking the left half onto a new thread while depth allows it
+Ranges below PARALLEL_SORT_THRESHOLD, or a failed thread start, fall back to merge_sort()
+Both halves use disjoint parts of the shared scratch buffer
+*/
+static void parallel_merge_sort_range(const StudentStore *store, int *order, int *scratch, int start, int end, int depth) {
+    if (depth <= 0 || end - start + 1 < PARALLEL_SORT_THRESHOLD) {
+        merge_sort(store, order, scratch, start, end);
+        return;
+    }
+
+    int mid = start + (end - start) / 2;
+    SortTask left = {store, order, scratch, start, mid, depth - 1};
+    pthread_t thread;
+    int forked = pthread_create(&thread, NULL, parallel_merge_sort_task, &left) == 0;
+    if (!forked) merge_sort(store, order, scratch, start, mid);
+
+    parallel_merge_sort_range(store, order, scratch, mid + 1, end, depth - 1);
+    if (forked) pthread_join(thread, NULL);
+
+    merge(store, order, scratch, start, mid, end);
+}
+
+static void* parallel_merge_sort_task(void *arg) {
+    SortTask *task = (SortTask *) arg;
+    parallel_merge_sort_range(task->store, task->order, task->scratch, task->start, task->end, task->depth);
+    return NULL;
+}
+
+/*
+Sorts the student indexes in order, students are left untouched
+Uses up to threads workers by splitting the top levels of the recursion, with the same
+stable order as a serial merge_sort()
+One scratch buffer is allocated for the whole sort
+*/
+static void sort_students(const StudentStore *store, int *order, int student_count, int threads) {
+    int *scratch = (int *) check_allocation(malloc(sizeof(int) * (student_count > 0 ? student_count : 1)));
+
+    int depth = 0;
+    while ((2 << depth) <= threads) depth++;
+    parallel_merge_sort_range(store, order, scratch, 0, student_count - 1, depth);
+
+    free(scratch);
+}
+
+/*
+Packs the date and the last name prefix of a student into a radix key
+Zero padding keeps the strcmp order of names shorter than the prefix
+*/
+static RadixItem encode_radix_key(const StudentStore *store, int index) {
+    unsigned char bytes[16] = {0};
+    int birth_date = store->birth_date[index];
+    bytes[0] = (unsigned char) (birth_date / 10000 - 1950);
+    bytes[1] = (unsigned char) (birth_date / 100 % 100);
+    bytes[2] = (unsigned char) (birth_date % 100);
+    const char *last_name = store->name_key[index]; // Ends at the null byte after the last name
+    for (int i = 0; i < RADIX_NAME_PREFIX && last_name[i] != '\0'; i++) {
+        bytes[3 + i] = (unsigned char) last_name[i];
+    }
+
+    RadixItem item = {0, 0, index};
+    for (int i = 0; i < 8; i++) {
+        item.high = (item.high << 8) | bytes[i];
+        item.low = (item.low << 8) | bytes[8 + i];
+    }
+    return item;
+}
+
+/*
+Sorts the student indexes in order using an LSD radix sort on the fixed width keys
+Passes where every key has the same byte are skipped
+Runs of equal keys (same date and last name prefix) are finished with the stable merge sort,
+so the result is identical to sort_students()
+*/
+static void radix_sort_students(const StudentStore *store, int *order, int student_count) {
+    int n = student_count > 0 ? student_count : 1;
+    RadixItem *items = (RadixItem *) check_allocation(malloc(sizeof(RadixItem) * n));
+    RadixItem *buffer = (RadixItem *) check_allocation(malloc(sizeof(RadixItem) * n));
+    int *scratch = (int *) check_allocation(malloc(sizeof(int) * n));
+    for (int i = 0; i < student_count; i++) {
+        items[i] = encode_radix_key(store, order[i]);
+    }
+
+    for (int pass = 0; pass < 16; pass++) {
+        int shift = (pass % 8) * 8;
+        int counts[256] = {0};
+        for (int i = 0; i < student_count; i++) {
+            uint64_t word = pass < 8 ? items[i].low : items[i].high;
+            counts[(word >> shift) & 0xff]++;
+        }
+        if (student_count == 0 || counts[((pass < 8 ? items[0].low : items[0].high) >> shift) & 0xff] == student_count) {
+            continue;
+        }
+
+        int position = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            int count = counts[digit];
+            counts[digit] = position;
+            position += count;
+        }
+        for (int i = 0; i < student_count; i++) {
+            uint64_t word = pass < 8 ? items[i].low : items[i].high;
+            buffer[counts[(word >> shift) & 0xff]++] = items[i];
+        }
+        RadixItem *temp = items;
+        items = buffer;
+        buffer = temp;
+    }
+
+    for (int i = 0; i < student_count; i++) {
+        order[i] = items[i].index;
+    }
+
+    // Tiebreak equal keys with the full comparator
+    int run_start = 0;
+    for (int i = 1; i <= student_count; i++) {
+        if (i == student_count || items[i].high != items[run_start].high || items[i].low != items[run_start].low) {
+            if (i - run_start > 1) merge_sort(store, order, scratch, run_start, i - 1);
+            run_start = i;
+        }
+    }
+
+    free(items);
+    free(buffer);
+    free(scratch);
+}
+
+/*
+Returns 1 if student a sorts strictly before student b
+*/
+static int adaptive_less(AdaptiveSort *sort, int a, int b) {
+    sort->comparisons++;
+    return student_comparator(sort->store, a, b) < 0;
+}
+
+/*
+Returns the length of the run starting at order[start], never past end (exclusive)
+A run is either non-descending or strictly descending, a descending run is reversed in place
+Only strictly descending runs are reversed, so equal students never swap and the sort stays stable
+*/
+static int count_run(AdaptiveSort *sort, int start, int end) {
+    int *order = sort->order;
+    int i = start + 1;
+    if (i >= end) return end - start;
+    if (adaptive_less(sort, order[i], order[i - 1])) {
+        while (i + 1 < end && adaptive_less(sort, order[i + 1], order[i])) {
+            i++;
+        }
+        for (int lo = start, hi = i; lo < hi; lo++, hi--) {
+            int temp = order[lo];
+            order[lo] = order[hi];
+            order[hi] = temp;
+        }
+    } else {
+        while (i + 1 < end && !adaptive_less(sort, order[i + 1], order[i])) {
+            i++;
+        }
+    }
+    return i + 1 - start;
+}
+
+/*
+Extends the sorted order[start..sorted - 1] to order[start..end - 1] by binary insertion
+Each student goes after any equal ones already placed
+*/
+static void binary_insertion_sort(AdaptiveSort *sort, int start, int sorted, int end) {
+    int *order = sort->order;
+    for (int i = sorted; i < end; i++) {
+        int pivot = order[i];
+        int lo = start, hi = i;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (adaptive_less(sort, pivot, order[mid])) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        memmove(order + lo + 1, order + lo, sizeof(int) * (i - lo));
+        order[lo] = pivot;
+    }
+}
+
+/*
+Returns where key goes in the sorted run[0..length - 1], before any equal students
+Searches outwards from run[hint] in steps of 1, 3, 7, ... then binary searches the last step,
+so finding a position k away from the hint takes O(log k) comparisons
+*/
+static int gallop_left(AdaptiveSort *sort, int key, const int *run, int length, int hint) {
+    int last = 0, offset = 1;
+    if (adaptive_less(sort, run[hint], key)) {
+        // run[hint] < key, gallop right until run[hint + last] < key <= run[hint + offset]
+        int max_offset = length - hint;
+        while (offset < max_offset && adaptive_less(sort, run[hint + offset], key)) {
+            last = offset;
+            offset = offset < max_offset / 2 ? offset * 2 + 1 : max_offset;
+        }
+        if (offset > max_offset) offset = max_offset;
+        last += hint;
+        offset += hint;
+    } else {
+        // key <= run[hint], gallop left until run[hint - offset] < key <= run[hint - last]
+        int max_offset = hint + 1;
+        while (offset < max_offset && !adaptive_less(sort, run[hint - offset], key)) {
+            last = offset;
+            offset = offset < max_offset / 2 ? offset * 2 + 1 : max_offset;
+        }
+        if (offset > max_offset) offset = max_offset;
+        int temp = last;
+        last = hint - offset;
+        offset = hint - temp;
+    }
+
+    // run[last] < key <= run[offset], last may be -1 and offset may be length
+    last++;
+    while (last < offset) {
+        int mid = last + (offset - last) / 2;
+        if (adaptive_less(sort, run[mid], key)) {
+            last = mid + 1;
+        } else {
+            offset = mid;
+        }
+    }
+    return offset;
+}
+
+/*
+Like gallop_left() but returns the position after any students equal to key
+*/
+static int gallop_right(AdaptiveSort *sort, int key, const int *run, int length, int hint) {
+    int last = 0, offset = 1;
+    if (adaptive_less(sort, key, run[hint])) {
+        // key < run[hint], gallop left until run[hint - offset] <= key < run[hint - last]
+        int max_offset = hint + 1;
+        while (offset < max_offset && adaptive_less(sort, key, run[hint - offset])) {
+            last = offset;
+            offset = offset < max_offset / 2 ? offset * 2 + 1 : max_offset;
+        }
+        if (offset > max_offset) offset = max_offset;
+        int temp = last;
+        last = hint - offset;
+        offset = hint - temp;
+    } else {
+        // run[hint] <= key, gallop right until run[hint + last] <= key < run[hint + offset]
+        int max_offset = length - hint;
+        while (offset < max_offset && !adaptive_less(sort, key, run[hint + offset])) {
+            last = offset;
+            offset = offset < max_offset / 2 ? offset * 2 + 1 : max_offset;
+        }
+        if (offset > max_offset) offset = max_offset;
+        last += hint;
+        offset += hint;
+    }
+
+    // run[last] <= key < run[offset]
+    last++;
+    while (last < offset) {
+        int mid = last + (offset - last) / 2;
+        if (adaptive_less(sort, key, run[mid])) {
+            offset = mid;
+        } else {
+            last = mid + 1;
+        }
+    }
+    return offset;
+}
+
+/*
+Merges two adjacent runs a = order[a_start..] and b, the shorter a is copied to scratch
+The caller guarantees b[0] < a[0] and that the last of a sorts after every student of b
+A side that wins min_gallop times in a row switches the merge to galloping, which moves whole
+blocks found by gallop_left() and gallop_right() until the blocks get short again
+*/
+static void merge_low(AdaptiveSort *sort, int a_start, int a_length, int b_length) {
+    int *a = sort->scratch;
+    int *b = sort->order + a_start + a_length;
+    int *dest = sort->order + a_start;
+    memcpy(a, dest, sizeof(int) * a_length);
+    int min_gallop = sort->min_gallop;
+
+    *dest++ = *b++;
+    b_length--;
+    while (b_length > 0 && a_length > 1) {
+        // One at a time until a run keeps winning
+        int a_wins = 0, b_wins = 0;
+        while (b_length > 0 && a_length > 1 && a_wins < min_gallop && b_wins < min_gallop) {
+            if (adaptive_less(sort, *b, *a)) {
+                *dest++ = *b++;
+                b_length--;
+                b_wins++;
+                a_wins = 0;
+            } else {
+                *dest++ = *a++;
+                a_length--;
+                a_wins++;
+                b_wins = 0;
+            }
+        }
+
+        // Gallop while it moves long enough blocks, each round makes it easier to enter again
+        int galloping = a_wins >= min_gallop || b_wins >= min_gallop;
+        min_gallop++;
+        while (galloping && b_length > 0 && a_length > 1) {
+            if (min_gallop > 1) min_gallop--;
+            a_wins = gallop_right(sort, *b, a, a_length, 0);
+            memcpy(dest, a, sizeof(int) * a_wins);
+            dest += a_wins;
+            a += a_wins;
+            a_length -= a_wins;
+            if (a_length <= 1) break;
+            *dest++ = *b++;
+            b_length--;
+            if (b_length == 0) break;
+
+            b_wins = gallop_left(sort, *a, b, b_length, 0);
+            memmove(dest, b, sizeof(int) * b_wins);
+            dest += b_wins;
+            b += b_wins;
+            b_length -= b_wins;
+            if (b_length == 0) break;
+            *dest++ = *a++;
+            a_length--;
+            galloping = a_wins >= ADAPTIVE_MIN_GALLOP || b_wins >= ADAPTIVE_MIN_GALLOP;
+        }
+        min_gallop++;
+    }
+    sort->min_gallop = min_gallop;
+
+    if (b_length == 0 || a_length == 0) {
+        memcpy(dest, a, sizeof(int) * a_length);
+    } else {
+        // The last student of a sorts after the rest of b
+        memmove(dest, b, sizeof(int) * b_length);
+        dest[b_length] = *a;
+    }
+}
+
+/*
+Mirror of merge_low() for a longer a: the shorter b is copied to scratch and the merge runs
+from the back
+The caller guarantees the same as for merge_low()
+*/
+static void merge_high(AdaptiveSort *sort, int a_start, int a_length, int b_length) {
+    int *a_base = sort->order + a_start;
+    int *b_base = sort->scratch;
+    memcpy(b_base, a_base + a_length, sizeof(int) * b_length);
+    int *a = a_base + a_length - 1;
+    int *b = b_base + b_length - 1;
+    int *dest = a_base + a_length + b_length - 1;
+    int min_gallop = sort->min_gallop;
+
+    *dest-- = *a--;
+    a_length--;
+    while (a_length > 0 && b_length > 1) {
+        int a_wins = 0, b_wins = 0;
+        while (a_length > 0 && b_length > 1 && a_wins < min_gallop && b_wins < min_gallop) {
+            if (adaptive_less(sort, *b, *a)) {
+                *dest-- = *a--;
+                a_length--;
+                a_wins++;
+                b_wins = 0;
+            } else {
+                *dest-- = *b--;
+                b_length--;
+                b_wins++;
+                a_wins = 0;
+            }
+        }
+
+        int galloping = a_wins >= min_gallop || b_wins >= min_gallop;
+        min_gallop++;
+        while (galloping && a_length > 0 && b_length > 1) {
+            if (min_gallop > 1) min_gallop--;
+            a_wins = a_length - gallop_right(sort, *b, a_base, a_length, a_length - 1);
+            dest -= a_wins;
+            a -= a_wins;
+            memmove(dest + 1, a + 1, sizeof(int) * a_wins);
+            a_length -= a_wins;
+            if (a_length == 0) break;
+            *dest-- = *b--;
+            b_length--;
+            if (b_length <= 1) break;
+
+            b_wins = b_length - gallop_left(sort, *a, b_base, b_length, b_length - 1);
+            dest -= b_wins;
+            b -= b_wins;
+            memcpy(dest + 1, b + 1, sizeof(int) * b_wins);
+            b_length -= b_wins;
+            if (b_length <= 1) break;
+            *dest-- = *a--;
+            a_length--;
+            galloping = a_wins >= ADAPTIVE_MIN_GALLOP || b_wins >= ADAPTIVE_MIN_GALLOP;
+        }
+        min_gallop++;
+    }
+    sort->min_gallop = min_gallop;
+
+    if (a_length == 0 || b_length == 0) {
+        memcpy(dest + 1 - b_length, b_base, sizeof(int) * b_length);
+    } else {
+        // The first student of b sorts before the rest of a
+        dest -= a_length;
+        a -= a_length;
+        memmove(dest + 1, a + 1, sizeof(int) * a_length);
+        *dest = *b;
+    }
+}
+
+/*
+Merges runs i and i + 1 of the stack into run i
+Students of a already before b[0], and of b already after the last of a, are left where they are
+*/
+static void merge_at(AdaptiveSort *sort, int i) {
+    int a_start = sort->run_start[i];
+    int a_length = sort->run_length[i];
+    int b_start = sort->run_start[i + 1];
+    int b_length = sort->run_length[i + 1];
+    sort->run_length[i] = a_length + b_length;
+    if (i == sort->run_count - 3) {
+        sort->run_start[i + 1] = sort->run_start[i + 2];
+        sort->run_length[i + 1] = sort->run_length[i + 2];
+    }
+    sort->run_count--;
+
+    int skip = gallop_right(sort, sort->order[b_start], sort->order + a_start, a_length, 0);
+    a_start += skip;
+    a_length -= skip;
+    if (a_length == 0) return;
+    b_length = gallop_left(sort, sort->order[a_start + a_length - 1], sort->order + b_start, b_length, b_length - 1);
+    if (b_length == 0) return;
+
+    if (a_length <= b_length) {
+        merge_low(sort, a_start, a_length, b_length);
+    } else {
+        merge_high(sort, a_start, a_length, b_length);
+    }
+}
+
+/*
+Merges runs on the stack until each run is longer than the next two together and than the next
+one, which keeps the stack short and the merges balanced
+*/
+static void merge_collapse(AdaptiveSort *sort) {
+    int *length = sort->run_length;
+    while (sort->run_count > 1) {
+        int n = sort->run_count - 2;
+        if ((n > 0 && length[n - 1] <= length[n] + length[n + 1]) ||
+            (n > 1 && length[n - 2] <= length[n - 1] + length[n])) {
+            if (length[n - 1] < length[n + 1]) n--;
+            merge_at(sort, n);
+        } else if (length[n] <= length[n + 1]) {
+            merge_at(sort, n);
+        } else {
+            break;
+        }
+    }
+}
+
+/*
+Shortest run worth merging for count students, between 32 and 64
+Picked so count / min run is a power of two or just below one, which balances the final merges
+*/
+static int adaptive_min_run(int count) {
+    int extra = 0;
+    while (count >= 64) {
+        extra |= count & 1;
+        count >>= 1;
+    }
+    return count + extra;
+}
+
+/*
+Sorts the student indexes in order with a stable natural merge sort (Timsort)
+Existing runs in the input are found and merged instead of sorted again, short runs are
+extended by binary insertion, and merges gallop over long stretches taken from one run
+Already sorted input costs n - 1 comparisons, sorted input with a few appended students close
+to linear, anything else at most O(n log n)
+Same order as sort_students()
+*/
+static void adaptive_sort_students(const StudentStore *store, int *order, int student_count) {
+    if (student_count < 2) return;
+    AdaptiveSort sort = {0};
+    sort.store = store;
+    sort.order = order;
+    sort.min_gallop = ADAPTIVE_MIN_GALLOP;
+    // Only the shorter run of a merge is copied
+    sort.scratch = (int *) check_allocation(malloc(sizeof(int) * (student_count / 2 + 1)));
+
+    int min_run = adaptive_min_run(student_count);
+    int start = 0;
+    while (start < student_count) {
+        int length = count_run(&sort, start, student_count);
+        if (length < min_run) {
+            int extended = student_count - start < min_run ? student_count - start : min_run;
+            binary_insertion_sort(&sort, start, start + length, start + extended);
+            length = extended;
+        }
+        sort.run_start[sort.run_count] = start;
+        sort.run_length[sort.run_count] = length;
+        sort.run_count++;
+        merge_collapse(&sort);
+        start += length;
+    }
+    while (sort.run_count > 1) {
+        int n = sort.run_count - 2;
+        if (n > 0 && sort.run_length[n - 1] < sort.run_length[n + 1]) n--;
+        merge_at(&sort, n);
+    }
+
+    stats_add(&run_stats.comparisons, sort.comparisons);
+    free(sort.scratch);
+}
+
+/*
+Sorts the student indexes in order with the engine picked in options
+With verify_sort the result is checked against the merge sort, returns 0 if they differ
+*/
+static int sort_with_engine(const StudentStore *store, int *order, int student_count, RunOptions *options) {
+    int *expected = NULL;
+    if (options->verify_sort) {
+        expected = (int *) check_allocation(malloc(sizeof(int) * (student_count > 0 ? student_count : 1)));
+        memcpy(expected, order, sizeof(int) * student_count);
+        sort_students(store, expected, student_count, options->threads);
+    }
+
+    if (options->sort_engine == SORT_RADIX) {
+        radix_sort_students(store, order, student_count);
+    } else if (options->sort_engine == SORT_ADAPTIVE) {
+        adaptive_sort_students(store, order, student_count);
+    } else {
+        sort_students(store, order, student_count, options->threads);
+    }
+
+    int verified = 1;
+    if (options->verify_sort) {
+        verified = memcmp(order, expected, sizeof(int) * student_count) == 0;
+        free(expected);
+    }
+    return verified;
+}
+
+/*
+Ends the program when --verify-sort found the orders differ, for the command line paths
+*/
+static void exit_on_sort_mismatch(int verified) {
+    if (!verified) {
+        fprintf(stderr, "Sort verification failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+Splits the students by type into two index lists, each in input order
+*/
+static void partition_students(const StudentStore *store, Partitions *partitions) {
+    int student_count = store->count;
+    int n = student_count > 0 ? student_count : 1;
+    partitions->domestic = (int *) check_allocation(malloc(sizeof(int) * n));
+    partitions->international = (int *) check_allocation(malloc(sizeof(int) * n));
+    partitions->domestic_count = 0;
+    partitions->international_count = 0;
+    for (int i = 0; i < student_count; i++) {
+        if (store->type[i] == DOMESTIC) {
+            partitions->domestic[partitions->domestic_count++] = i;
+        } else {
+            partitions->international[partitions->international_count++] = i;
+        }
+    }
+}
+
+/*
+Sorts each partition on its own
+Returns 0 if --verify-sort found an order differing from the merge sort
+*/
+static int sort_partitions(const StudentStore *store, Partitions *partitions, RunOptions *options) {
+    int verified = sort_with_engine(store, partitions->domestic, partitions->domestic_count, options);
+    return sort_with_engine(store, partitions->international, partitions->international_count, options) && verified;
+}
+
+/*
+Sorts an index list whose first sorted_count entries are already in order
+Only the rest is sorted, then both runs are merged linearly, the sorted run wins ties
+Returns 0 if --verify-sort found an order differing from the merge sort
+*/
+static int sort_appended(const StudentStore *store, int *order, int count, int sorted_count, RunOptions *options) {
+    if (sorted_count >= count) return 1;
+    int verified = sort_with_engine(store, order + sorted_count, count - sorted_count, options);
+    if (sorted_count == 0) return verified;
+
+    int *scratch = (int *) check_allocation(malloc(sizeof(int) * sorted_count));
+    // merge() only uses scratch for the left run, which starts at 0
+    merge(store, order, scratch, 0, sorted_count - 1, count - 1);
+    free(scratch);
+    return verified;
+}
+
+/*
+Like sort_partitions() when the rows below sorted_rows were loaded from a snapshot
+Those rows are in order already, so only the appended students are sorted
+*/
+static int sort_appended_partitions(const StudentStore *store, Partitions *partitions, int sorted_rows,
+                             RunOptions *options) {
+    int sorted[2] = {0, 0};
+    for (int i = 0; i < sorted_rows; i++) {
+        sorted[store->type[i]]++;
+    }
+    int verified = sort_appended(store, partitions->domestic, partitions->domestic_count, sorted[DOMESTIC], options);
+    return sort_appended(store, partitions->international, partitions->international_count, sorted[INTERNATIONAL],
+                         options) && verified;
+}
+
+/*
+Returns the combined order (option 3) by a linear merge of the sorted partitions
+A domestic and an international student never compare equal, so the merge gives the same order
+as sorting everything together
+*/
+static int* merge_partitions(const StudentStore *store, const Partitions *partitions) {
+    int total = partitions->domestic_count + partitions->international_count;
+    int *order = (int *) check_allocation(malloc(sizeof(int) * (total > 0 ? total : 1)));
+
+    int i = 0, j = 0, k = 0;
+    while (i < partitions->domestic_count && j < partitions->international_count) {
+        if (student_comparator(store, partitions->domestic[i], partitions->international[j]) <= 0) {
+            order[k++] = partitions->domestic[i++];
+        } else {
+            order[k++] = partitions->international[j++];
+        }
+    }
+    while (i < partitions->domestic_count) {
+        order[k++] = partitions->domestic[i++];
+    }
+    while (j < partitions->international_count) {
+        order[k++] = partitions->international[j++];
+    }
+    return order;
+}
+
+static void free_partitions(Partitions *partitions) {
+    free(partitions->domestic);
+    free(partitions->international);
+    partitions->domestic = partitions->international = NULL;
+}
+
+/*
+Returns count capped at limit, a limit of 0 means no cap
+*/
+static int apply_limit(int count, int limit) {
+    return limit > 0 && count > limit ? limit : count;
+}
+
+/*
+Writes every requested output from one sorted set of partitions
+Each target gets at most limit students, 0 writes them all
+The combined order is only built if some target asks for option 3
+*/
+static void write_targets(const OutputTarget *targets, int target_count, const StudentStore *store,
+                   const Partitions *partitions, int limit) {
+    int *combined = NULL;
+    for (int t = 0; t < target_count; t++) {
+        switch (targets[t].option) {
+            case 1: {
+                exit_on_write_error(output_students(targets[t].fp, store, partitions->domestic,
+                                                    apply_limit(partitions->domestic_count, limit)));
+                break;
+            }
+            case 2: {
+                exit_on_write_error(output_students(targets[t].fp, store, partitions->international,
+                                                    apply_limit(partitions->international_count, limit)));
+                break;
+            }
+            case 3: {
+                if (combined == NULL) combined = merge_partitions(store, partitions);
+                int count = partitions->domestic_count + partitions->international_count;
+                exit_on_write_error(output_students(targets[t].fp, store, combined, apply_limit(count, limit)));
+                break;
+            }
+        }
+    }
+    free(combined);
+}
+
+/*
+Creates an empty spill file in the working directory
+The file is unlinked right away so it disappears on close or on any exit
+output_fp receives errors
+*/
+static void spill_open(SpillFile *spill, FILE *output_fp) {
+    char path[] = "a2_run_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) output_error(output_fp, "Cannot create temp file");
+    unlink(path);
+    spill->fp = fdopen(fd, "w+");
+    if (spill->fp == NULL) output_error(output_fp, "Cannot open temp file");
+    spill->run_capacity = INITIAL_MALLOC;
+    spill->run_start = (off_t *) check_allocation(malloc(sizeof(off_t) * (spill->run_capacity + 1)));
+    spill->run_start[0] = 0;
+    spill->run_count = 0;
+}
+
+/*
+Ends the run written since the last one at the current end of the file
+*/
+static void spill_end_run(SpillFile *spill, FILE *output_fp) {
+    if (spill->run_count >= spill->run_capacity) {
+        spill->run_capacity *= 2;
+        spill->run_start = check_allocation(realloc(spill->run_start, sizeof(off_t) * (spill->run_capacity + 1)));
+    }
+    off_t end = lseek(fileno(spill->fp), 0, SEEK_END);
+    if (end == -1) output_error(output_fp, "Cannot write temp file");
+    spill->run_start[++spill->run_count] = end;
+}
+
+/*
+Drops every run, the file is kept for the next ones
+*/
+static void spill_clear(SpillFile *spill, FILE *output_fp) {
+    if (ftruncate(fileno(spill->fp), 0) != 0) output_error(output_fp, "Cannot write temp file");
+    lseek(fileno(spill->fp), 0, SEEK_SET);
+    spill->run_count = 0;
+}
+
+static void spill_close(SpillFile *spill) {
+    if (spill->fp != NULL) fclose(spill->fp);
+    free(spill->run_start);
+}
+
+/*
+Sorts the students held in memory and appends them to spill as a new run in the option 3 format
+*/
+static void spill_sorted_run(SpillFile *spill, const StudentStore *store, RunOptions *options, FILE *output_fp) {
+    if (spill->fp == NULL) spill_open(spill, output_fp);
+
+    Partitions partitions;
+    partition_students(store, &partitions);
+    exit_on_sort_mismatch(sort_partitions(store, &partitions, options));
+    int *combined = merge_partitions(store, &partitions);
+    int written = output_students(spill->fp, store, combined, store->count);
+    free(combined);
+    free_partitions(&partitions);
+
+    if (!written) output_error(output_fp, "Cannot write temp file");
+    spill_end_run(spill, output_fp);
+}
+
+/*
+Loads the next record of a run into reader->current
+Returns 0 once the run is exhausted
+*/
+static int run_reader_next(RunReader *reader, FILE *output_fp) {
+    char *newline;
+    while ((newline = memchr(reader->buffer + reader->start, '\n', reader->used - reader->start)) == NULL) {
+        if (reader->offset >= reader->end) return 0; // Runs end with a newline, nothing is left
+        // Keeps the partial line at the front and reads after it, growing only for longer lines
+        memmove(reader->buffer, reader->buffer + reader->start, reader->used - reader->start);
+        reader->used -= reader->start;
+        reader->start = 0;
+        if (reader->used == reader->capacity) {
+            reader->capacity *= 2;
+            reader->buffer = check_allocation(realloc(reader->buffer, reader->capacity));
+        }
+        size_t wanted = reader->capacity - reader->used;
+        if ((off_t) wanted > reader->end - reader->offset) wanted = (size_t) (reader->end - reader->offset);
+        ssize_t result = pread(reader->fd, reader->buffer + reader->used, wanted, reader->offset);
+        if (result <= 0) output_error(output_fp, "Cannot read temp file");
+        reader->used += (size_t) result;
+        reader->offset += result;
+    }
+
+    char *line = reader->buffer + reader->start;
+    *newline = '\0';
+    reader->start = newline + 1 - reader->buffer;
+    arena_reset(&reader->arena);
+    parse_line(line, &reader->current, 0, output_fp, &reader->arena, 1);
+    return 1;
+}
+
+/*
+Returns 1 if run a should be emitted before run b, earlier runs win ties to keep the sort stable
+*/
+static int run_precedes(RunReader *readers, int a, int b) {
+    int cmp = compare_rows(&readers[a].current, 0, &readers[b].current, 0);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+static void run_heap_sift_down(RunReader *readers, int *heap, int heap_size, int position) {
+    while (1) {
+        int smallest = position;
+        int left = 2 * position + 1;
+        int right = left + 1;
+        if (left < heap_size && run_precedes(readers, heap[left], heap[smallest])) smallest = left;
+        if (right < heap_size && run_precedes(readers, heap[right], heap[smallest])) smallest = right;
+        if (smallest == position) return;
+        int temp = heap[position];
+        heap[position] = heap[smallest];
+        heap[smallest] = temp;
+        position = smallest;
+    }
+}
+
+/*
+k-way merges run_count runs of spill from first_run on straight into every output target with a
+binary heap of run heads
+output_fp receives errors
+Returns 0 if a target could not be written
+*/
+static int merge_runs(const SpillFile *spill, int first_run, int run_count, FILE *output_fp,
+               const OutputTarget *targets, int target_count) {
+    RunReader *readers = (RunReader *) check_allocation(calloc(run_count, sizeof(RunReader)));
+    int *heap = (int *) check_allocation(malloc(sizeof(int) * run_count));
+
+    OutputWriter *writers = (OutputWriter *) check_allocation(malloc(sizeof(OutputWriter) * target_count));
+    for (int t = 0; t < target_count; t++) {
+        writer_init(&writers[t], targets[t].fp);
+    }
+    int heap_size = 0;
+    for (int i = 0; i < run_count; i++) {
+        readers[i].fd = fileno(spill->fp);
+        readers[i].offset = spill->run_start[first_run + i];
+        readers[i].end = spill->run_start[first_run + i + 1];
+        readers[i].capacity = RUN_READ_SIZE;
+        readers[i].buffer = (char *) check_allocation(malloc(readers[i].capacity));
+        store_reserve(&readers[i].current, 1);
+        if (run_reader_next(&readers[i], output_fp)) heap[heap_size++] = i;
+    }
+    for (int i = heap_size / 2 - 1; i >= 0; i--) {
+        run_heap_sift_down(readers, heap, heap_size, i);
+    }
+
+    while (heap_size > 0) {
+        RunReader *reader = &readers[heap[0]];
+        for (int t = 0; t < target_count; t++) {
+            if (option_includes(targets[t].option, reader->current.type[0])) output_student(&writers[t], &reader->current, 0);
+        }
+        if (!run_reader_next(reader, output_fp)) heap[0] = heap[--heap_size];
+        run_heap_sift_down(readers, heap, heap_size, 0);
+    }
+    int written = 1;
+    for (int t = 0; t < target_count; t++) {
+        if (!writer_finish(&writers[t])) written = 0;
+    }
+    free(writers);
+
+    for (int i = 0; i < run_count; i++) {
+        free(readers[i].buffer);
+        arena_release(&readers[i].arena);
+        store_free(&readers[i].current);
+    }
+    free(readers);
+    free(heap);
+    return written;
+}
+
+/*
+Merges the runs of spills[0] in groups of MERGE_FAN_IN into longer runs until at most
+MERGE_FAN_IN are left, going back and forth between the two spill files
+Returns the spill file holding the runs left
+*/
+static SpillFile* reduce_runs(SpillFile spills[2], FILE *output_fp) {
+    SpillFile *from = &spills[0];
+    SpillFile *to = &spills[1];
+    while (from->run_count > MERGE_FAN_IN) {
+        if (to->fp == NULL) spill_open(to, output_fp);
+        OutputTarget target = {3, to->fp};
+        // Groups are consecutive runs, so earlier runs still win ties in the longer ones
+        for (int first = 0; first < from->run_count; first += MERGE_FAN_IN) {
+            int count = from->run_count - first < MERGE_FAN_IN ? from->run_count - first : MERGE_FAN_IN;
+            if (!merge_runs(from, first, count, output_fp, &target, 1)) output_error(output_fp, "Cannot write temp file");
+            spill_end_run(to, output_fp);
+        }
+        spill_clear(from, output_fp);
+        SpillFile *temp = from;
+        from = to;
+        to = temp;
+    }
+    return from;
+}
+
+/*
+Out of core sort for inputs larger than memory
+Streams the input line by line, parsing into memory until options->memory_budget is reached,
+then spills a sorted run to a temp file. The runs are k-way merged into the output, at most
+MERGE_FAN_IN at a time, so two temp files are open however large the input is
+If the whole input fits in the budget nothing is spilled
+Same line semantics as read_lines(): reading stops at the first empty line
+Bad lines are handled per options->error_mode, collected ones are added to errors
+*/
+static void external_sort(FILE *input_fp, FILE *output_fp, const OutputTarget *targets, int target_count,
+                   RunOptions *options, ErrorLog *errors, Aggregates *aggregates) {
+    size_t record_overhead = store_row_size() + 2 * sizeof(int); // Columns plus its sort index and scratch slot
+    Arena arena = {0};
+    StudentStore store = {0};
+    store_reserve(&store, INITIAL_MALLOC);
+    SpillFile spills[2] = {{0}};
+
+    LineReader reader;
+    line_reader_init(&reader, input_fp);
+    char *line;
+    size_t length;
+    int line_number = 0;
+    long records = 0;
+    stats_begin(PHASE_PARSE); // Reading and parsing are one streaming phase here
+    while ((line = line_reader_next(&reader, &length)) != NULL) {
+        if (length == 0) break;
+
+        if (store.count >= store.capacity) store_reserve(&store, store.capacity * 2);
+        line_number++;
+        // Parsed in the line buffer, only a stored student is copied into the arena
+        const char *error = parse_record(line, &store, store.count, &arena, 0, &options->filter);
+        if (error == RECORD_FILTERED) continue;
+        if (error != NULL) {
+            if (options->error_mode == ON_ERROR_EXIT) output_error(output_fp, error);
+            error_log_add(errors, line_number, error);
+            continue;
+        }
+        if (aggregates != NULL) aggregate_student(aggregates, &store, store.count);
+        store.count++;
+        records++;
+
+        if (arena.used + store.count * record_overhead >= options->memory_budget) {
+            stats_end(PHASE_PARSE);
+            stats_begin(PHASE_SORT); // Sorting a run includes writing it out
+            spill_sorted_run(&spills[0], &store, options, output_fp);
+            stats_end(PHASE_SORT);
+            stats_begin(PHASE_PARSE);
+            store.count = 0;
+            arena_reset(&arena);
+        }
+    }
+    run_stats.bytes_read += reader.bytes_read;
+    line_reader_free(&reader);
+    stats_end(PHASE_PARSE);
+    run_stats.lines += line_number;
+    run_stats.records += records;
+
+    if (options->error_mode == ON_ERROR_REPORT && errors->count > 0) {
+        // Only the report is written, the spilled runs are simply closed
+    } else if (spills[0].run_count == 0) {
+        Partitions partitions;
+        stats_begin(PHASE_SORT);
+        partition_students(&store, &partitions);
+        exit_on_sort_mismatch(sort_partitions(&store, &partitions, options));
+        stats_end(PHASE_SORT);
+        stats_begin(PHASE_OUTPUT);
+        write_targets(targets, target_count, &store, &partitions, 0);
+        stats_end(PHASE_OUTPUT);
+        free_partitions(&partitions);
+    } else {
+        stats_begin(PHASE_SORT);
+        if (store.count > 0) spill_sorted_run(&spills[0], &store, options, output_fp);
+        SpillFile *spill = reduce_runs(spills, output_fp);
+        stats_end(PHASE_SORT);
+        stats_begin(PHASE_OUTPUT);
+        exit_on_write_error(merge_runs(spill, 0, spill->run_count, output_fp, targets, target_count));
+        stats_end(PHASE_OUTPUT);
+    }
+    spill_close(&spills[0]);
+    spill_close(&spills[1]);
+    store_free(&store);
+    arena_release(&arena);
+}
+
+/*
+Returns 1 if row a of the kept students comes after row b
+*/
+static int topk_after(const TopK *top, int a, int b) {
+    int cmp = student_comparator(&top->store, a, b);
+    return cmp > 0 || (cmp == 0 && top->sequence[a] > top->sequence[b]);
+}
+
+static void topk_sift_up(TopK *top, int *heap, int position) {
+    while (position > 0) {
+        int parent = (position - 1) / 2;
+        if (!topk_after(top, heap[position], heap[parent])) return;
+        int temp = heap[position];
+        heap[position] = heap[parent];
+        heap[parent] = temp;
+        position = parent;
+    }
+}
+
+static void topk_sift_down(TopK *top, int *heap, int heap_size, int position) {
+    while (1) {
+        int largest = position;
+        int left = 2 * position + 1;
+        int right = left + 1;
+        if (left < heap_size && topk_after(top, heap[left], heap[largest])) largest = left;
+        if (right < heap_size && topk_after(top, heap[right], heap[largest])) largest = right;
+        if (largest == position) return;
+        int temp = heap[position];
+        heap[position] = heap[largest];
+        heap[largest] = temp;
+        position = largest;
+    }
+}
+
+/*
+Doubles the rows available to the kept students, new rows own no buffer yet
+*/
+static void topk_grow(TopK *top) {
+    int old_capacity = top->store.capacity;
+    store_reserve(&top->store, old_capacity > 0 ? old_capacity * 2 : INITIAL_MALLOC);
+    int capacity = top->store.capacity;
+    top->owned = (char **) grow_column(top->owned, sizeof(char *), capacity);
+    top->owned_size = (size_t *) grow_column(top->owned_size, sizeof(size_t), capacity);
+    top->sequence = (int *) grow_column(top->sequence, sizeof(int), capacity);
+    top->heap[DOMESTIC] = (int *) grow_column(top->heap[DOMESTIC], sizeof(int), capacity);
+    top->heap[INTERNATIONAL] = (int *) grow_column(top->heap[INTERNATIONAL], sizeof(int), capacity);
+    for (int row = old_capacity; row < capacity; row++) {
+        top->owned[row] = NULL;
+        top->owned_size[row] = 0;
+    }
+}
+
+/*
+Copies the student in row 0 of candidate into row of the kept students
+The strings are copied into the row's own buffer, which is reused by whoever replaces it
+*/
+static void topk_store_row(TopK *top, int row, const StudentStore *candidate, int sequence) {
+    const char *name_key = candidate->name_key[0];
+    size_t last_length = strlen(name_key) + 1;
+    size_t key_size = last_length + strlen(name_key + last_length) + 1;
+    size_t text_size = (size_t) candidate->text_length[0] + 1;
+    if (top->owned_size[row] < text_size + key_size) {
+        free(top->owned[row]);
+        top->owned[row] = (char *) check_allocation(malloc(text_size + key_size));
+        top->owned_size[row] = text_size + key_size;
+        stats_add(&run_stats.allocations, 1);
+    }
+    char *buffer = top->owned[row];
+    memcpy(buffer, candidate->text[0], text_size);
+    memcpy(buffer + text_size, name_key, key_size);
+
+    StudentStore *store = &top->store;
+    store->birth_date[row] = candidate->birth_date[0];
+    store->gpa[row] = candidate->gpa[0];
+    store->status[row] = candidate->status[0];
+    store->type[row] = candidate->type[0];
+    store->text[row] = buffer;
+    store->text_length[row] = candidate->text_length[0];
+    store->name_key[row] = buffer + text_size;
+    top->sequence[row] = sequence;
+}
+
+/*
+Keeps the student in row 0 of candidate if it is among the first limit of its type so far
+*/
+static void topk_offer(TopK *top, const StudentStore *candidate, int sequence) {
+    int type = candidate->type[0];
+    int *heap_size = &top->heap_size[type];
+    if (*heap_size < top->limit) {
+        if (top->store.count >= top->store.capacity) topk_grow(top);
+        int row = top->store.count++;
+        topk_store_row(top, row, candidate, sequence);
+        top->heap[type][*heap_size] = row;
+        topk_sift_up(top, top->heap[type], (*heap_size)++);
+        return;
+    }
+
+    // Later lines lose ties, so only a strictly smaller student replaces the root
+    int root = top->heap[type][0];
+    if (compare_rows(candidate, 0, &top->store, root) >= 0) return;
+    topk_store_row(top, root, candidate, sequence);
+    topk_sift_down(top, top->heap[type], *heap_size, 0);
+}
+
+/*
+Heap sorts the kept rows of one type in place, the heap array ends up in comparator order
+*/
+static void topk_sort(TopK *top, StudentType type) {
+    int *heap = top->heap[type];
+    for (int end = top->heap_size[type] - 1; end > 0; end--) {
+        int temp = heap[0];
+        heap[0] = heap[end];
+        heap[end] = temp;
+        topk_sift_down(top, heap, end, 0);
+    }
+}
+
+static void topk_free(TopK *top) {
+    for (int row = 0; row < top->store.capacity; row++) {
+        free(top->owned[row]);
+    }
+    free(top->owned);
+    free(top->owned_size);
+    free(top->sequence);
+    free(top->heap[DOMESTIC]);
+    free(top->heap[INTERNATIONAL]);
+    store_free(&top->store);
+}
+
+/*
+Writes only the first options->limit students of every target without sorting the whole input
+The input streams through one line at a time and each type keeps a bounded heap of its best
+students, O(n log limit) time and O(limit) memory for the records
+The first limit students of option 3 are always among the kept students of both types
+Same line semantics as read_lines(), bad lines are handled per options->error_mode
+*/
+static void limit_sort(FILE *input_fp, FILE *output_fp, const OutputTarget *targets, int target_count,
+                RunOptions *options, ErrorLog *errors, Aggregates *aggregates) {
+    TopK top = {0};
+    top.limit = options->limit;
+    topk_grow(&top);
+    StudentStore candidate = {0};
+    store_reserve(&candidate, 1);
+    Arena arena = {0}; // Holds only the candidate's name key, reset before each line
+
+    LineReader reader;
+    line_reader_init(&reader, input_fp);
+    char *line;
+    size_t length;
+    int line_number = 0;
+    long records = 0;
+    stats_begin(PHASE_PARSE);
+    while ((line = line_reader_next(&reader, &length)) != NULL) {
+        if (length == 0) break;
+
+        line_number++;
+        arena_reset(&arena);
+        const char *error = parse_record(line, &candidate, 0, &arena, 1, &options->filter);
+        if (error == RECORD_FILTERED) continue;
+        if (error != NULL) {
+            if (options->error_mode == ON_ERROR_EXIT) output_error(output_fp, error);
+            error_log_add(errors, line_number, error);
+            continue;
         }
-        i++;
+        topk_offer(&top, &candidate, line_number);
+        if (aggregates != NULL) aggregate_student(aggregates, &candidate, 0);
+        records++;
     }
+    run_stats.bytes_read += reader.bytes_read;
+    line_reader_free(&reader);
+    stats_end(PHASE_PARSE);
+    run_stats.lines += line_number;
+    run_stats.records += records;
+
+    if (options->error_mode != ON_ERROR_REPORT || errors->count == 0) {
+        stats_begin(PHASE_SORT);
+        topk_sort(&top, DOMESTIC);
+        topk_sort(&top, INTERNATIONAL);
+        stats_end(PHASE_SORT);
+        Partitions partitions = {top.heap[DOMESTIC], top.heap_size[DOMESTIC],
+                                 top.heap[INTERNATIONAL], top.heap_size[INTERNATIONAL]};
+        stats_begin(PHASE_OUTPUT);
+        write_targets(targets, target_count, &top.store, &partitions, options->limit);
+        stats_end(PHASE_OUTPUT);
+    }
+
+    topk_free(&top);
+    store_free(&candidate);
+    arena_release(&arena);
 }
 
 /*
-Returns 1 if student a is less than student b
-Returns -1 if student b is less than student a
-Returns 0 if student a is equal to student b
+Reads, parses and sorts one of several input files into its own store and arena
+Same steps as the in-memory path of main() for a single file, bad lines are left out of the
+store and collected in file->errors, tagged with the file's path
+file->opened stays 0 if the file can't be opened
 */
-int student_comparator(Student a, Student b) {
-    // Initialize values
-    int a_birth_year;
-    int a_birth_month;
-    int a_birth_day;
-    char *a_last_name;
-    char *a_first_name;
-    char *a_gpa;
-    int a_TOEFL = -1;
-
-    int b_birth_year;
-    int b_birth_month;
-    int b_birth_day;
-    char *b_last_name;
-    char *b_first_name;
-    char *b_gpa;
-    int b_TOEFL = -1;
-
-    // Set the values
-    if (a.type == DOMESTIC) {
-        a_birth_year = atoi(a.student.domestic.birth_year);
-        a_birth_month = month_to_int(a.student.domestic.birth_month);
-        a_birth_day = atoi(a.student.domestic.birth_day);
-        a_last_name = (char *)malloc(strlen(a.student.domestic.last_name) + 1);
-        a_first_name = (char *)malloc(strlen(a.student.domestic.first_name) + 1);
-        strcpy(a_last_name, a.student.domestic.last_name);
-        strcpy(a_first_name, a.student.domestic.first_name);
-        a_gpa = a.student.domestic.gpa_str;
-    } else {
-        a_birth_year = atoi(a.student.international.birth_year);
-        a_birth_month = month_to_int(a.student.international.birth_month);
-        a_birth_day = atoi(a.student.international.birth_day);
-        a_last_name = (char *)malloc(strlen(a.student.international.last_name) + 1);
-        a_first_name = (char *)malloc(strlen(a.student.international.first_name) + 1);
-        strcpy(a_last_name, a.student.international.last_name);
-        strcpy(a_first_name, a.student.international.first_name);
-        a_gpa = a.student.international.gpa_str;
-        a_TOEFL = atoi(a.student.international.TOEFL_score);
-    }
-    if (b.type == DOMESTIC) {
-        b_birth_year = atoi(b.student.domestic.birth_year);
-        b_birth_month = month_to_int(b.student.domestic.birth_month);
-        b_birth_day = atoi(b.student.domestic.birth_day);
-        b_last_name = (char *)malloc(strlen(b.student.domestic.last_name) + 1);
-        b_first_name = (char *)malloc(strlen(b.student.domestic.first_name) + 1);
-        strcpy(b_last_name, b.student.domestic.last_name);
-        strcpy(b_first_name, b.student.domestic.first_name);
-        b_gpa = b.student.domestic.gpa_str;
+static void sort_input_file(InputFile *file, RunOptions *options) {
+    FILE *input_fp = strcmp(file->path, "-") == 0 ? stdin : fopen(file->path, "r");
+    if (input_fp == NULL) return;
+    file->opened = 1;
+    int first = fgetc(input_fp);
+    file->empty = first == EOF;
+    if (!file->empty) ungetc(first, input_fp);
+    if (map_input(input_fp, &file->mapped)) {
+        file->lines = split_mapped_lines(&file->mapped, &file->line_count);
+        file->bytes_read = file->mapped.size;
     } else {
-        b_birth_year = atoi(b.student.international.birth_year);
-        b_birth_month = month_to_int(b.student.international.birth_month);
-        b_birth_day = atoi(b.student.international.birth_day);
-        b_last_name = (char *)malloc(strlen(b.student.international.last_name) + 1);
-        b_first_name = (char *)malloc(strlen(b.student.international.first_name) + 1);
-        strcpy(b_last_name, b.student.international.last_name);
-        strcpy(b_first_name, b.student.international.first_name);
-        b_gpa = b.student.international.gpa_str;
-        b_TOEFL = atoi(b.student.international.TOEFL_score);
-    }
-
-    // Start comparisons
-    // Birth year
-    if (a_birth_year == b_birth_year) {
-        // printf("Birth year is the same.\n");
-        // Birth month
-        if (a_birth_month == b_birth_month) {
-            // printf("Birth month is the same.\n");
-            // Birth day
-            if (a_birth_day == b_birth_day) {
-                // printf("Birth day is the same.\n");
-                // Last Name
-                to_lower_case(a_last_name);
-                to_lower_case(b_last_name);
-                if (strcmp(a_last_name, b_last_name) == 0) {
-                    // printf("Last name is the same.\n");
-                    free(a_last_name);
-                    free(b_last_name);
-
-                    // First Name
-                    to_lower_case(a_first_name);
-                    to_lower_case(b_first_name);
-                    if (strcmp(a_first_name, b_first_name) == 0) {
-                        free(a_first_name);
-                        free(b_first_name);
-                        // printf("First name is the same.\n");
-
-                        // GPA
-                        double cmp_gpa = atof(a_gpa) - atof(b_gpa);
-                        double epsilon = 0.0001F;
-                        if (cmp_gpa <= epsilon && cmp_gpa >= (-1 * epsilon)) {
-                            // printf("GPA is the same.\n");
-                            // Status
-                            if (a_TOEFL == -1 && b_TOEFL == -1) {
-                                return 0;
-                            } else if (a_TOEFL != -1 && b_TOEFL == -1) {
-                                return 1;
-                            } else if (a_TOEFL == -1 && b_TOEFL != -1) {
-                                return -1;
-                            } else {
-                                // printf("Both students are INTERNATIONAL.\n");
-                                // TOEFL
-                                if (a_TOEFL == b_TOEFL) {
-                                    // printf("TOEFL score is the same.\n");
-                                    return 0;
-                                } else if (a_TOEFL > b_TOEFL) {
-                                    return 1;
-                                } else {
-                                    return -1;
-                                }
-                            }
-                        } else if (cmp_gpa > (-1 * epsilon)) {
-                            return 1;
-                        } else {
-                            return -1;
-                        }
-                    } else if (strcmp(a_first_name, b_first_name) > 0) {
-                        free(a_first_name);
-                        free(b_first_name);
-                        return 1;
-                    } else {
-                        free(a_first_name);
-                        free(b_first_name);
-                        return -1;
-                    }
-                } else if (strcmp(a_last_name, b_last_name) > 0) {
-                    free(a_last_name);
-                    free(a_first_name);
-                    free(b_last_name);
-                    free(b_first_name);
-                    return 1;
-                } else {
-                    free(a_last_name);
-                    free(a_first_name);
-                    free(b_last_name);
-                    free(b_first_name);
-                    return -1;
-                }
-            } else if (a_birth_day > b_birth_day) {
-                return 1;
+        file->lines = read_lines(input_fp, &file->line_count, &file->bytes_read, &file->arena);
+    }
+    if (input_fp != stdin) fclose(input_fp); // A mapping outlives its descriptor
+
+    generate_students_from_lines(file->lines, file->line_count, &file->store, &file->arena, options, &file->errors,
+                                 file->aggregates);
+    for (int i = 0; i < file->errors.count; i++) {
+        file->errors.errors[i].source = file->path;
+    }
+
+    Partitions partitions;
+    partition_students(&file->store, &partitions);
+    file->verified = sort_partitions(&file->store, &partitions, options);
+    file->order = merge_partitions(&file->store, &partitions);
+    free_partitions(&partitions);
+}
+
+static void* input_pool_task(void *arg) {
+    InputPool *pool = (InputPool *) arg;
+    int i;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->file_count) {
+        sort_input_file(&pool->files[i], &pool->options);
+    }
+    return NULL;
+}
+
+/*
+Returns 1 if source a should be emitted before source b
+An exhausted source comes after everything, earlier files win ties as in the concatenated input
+*/
+static int source_precedes(const MergeSource *sources, int a, int b) {
+    if (sources[a].position >= sources[a].count) return 0;
+    if (sources[b].position >= sources[b].count) return 1;
+    int cmp = compare_rows(sources[a].store, sources[a].order[sources[a].position],
+                           sources[b].store, sources[b].order[sources[b].position]);
+    return cmp < 0 || (cmp == 0 && a < b);
+}
+
+/*
+k-way merges the sorted files straight into every output target with a loser tree
+Leaves are the files, tree[node] holds the loser of the match at each internal node and tree[0]
+the overall winner. Once the winner advances only its path to the root is replayed, one
+comparison per level against the stored losers, where a binary heap compares both children
+*/
+static void merge_input_files(const InputFile *files, int file_count, const OutputTarget *targets, int target_count) {
+    MergeSource *sources = (MergeSource *) check_allocation(malloc(sizeof(MergeSource) * file_count));
+    int *tree = (int *) check_allocation(malloc(sizeof(int) * file_count));
+    // Winner of every node, leaves included
+    int *winners = (int *) check_allocation(malloc(sizeof(int) * 2 * file_count));
+    OutputWriter *writers = (OutputWriter *) check_allocation(malloc(sizeof(OutputWriter) * target_count));
+
+    // Leaf of file i is node file_count + i, the children of node n are 2n and 2n + 1
+    for (int i = 0; i < file_count; i++) {
+        sources[i].store = &files[i].store;
+        sources[i].order = files[i].order;
+        sources[i].count = files[i].store.count;
+        sources[i].position = 0;
+        winners[file_count + i] = i;
+    }
+    for (int node = file_count - 1; node >= 1; node--) {
+        int left = winners[2 * node];
+        int right = winners[2 * node + 1];
+        int left_wins = source_precedes(sources, left, right);
+        winners[node] = left_wins ? left : right;
+        tree[node] = left_wins ? right : left;
+    }
+    tree[0] = file_count > 1 ? winners[1] : 0;
+    free(winners);
+
+    for (int t = 0; t < target_count; t++) {
+        writer_init(&writers[t], targets[t].fp);
+    }
+    while (sources[tree[0]].position < sources[tree[0]].count) {
+        int winner = tree[0];
+        MergeSource *source = &sources[winner];
+        int row = source->order[source->position++];
+        for (int t = 0; t < target_count; t++) {
+            if (option_includes(targets[t].option, source->store->type[row])) {
+                output_student(&writers[t], source->store, row);
+            }
+        }
+        for (int node = (file_count + winner) / 2; node >= 1; node /= 2) {
+            if (source_precedes(sources, tree[node], winner)) {
+                int loser = winner;
+                winner = tree[node];
+                tree[node] = loser;
+            }
+        }
+        tree[0] = winner;
+    }
+    for (int t = 0; t < target_count; t++) {
+        exit_on_write_error(writer_finish(&writers[t]));
+    }
+
+    free(writers);
+    free(sources);
+    free(tree);
+}
+
+/*
+Sorts several input files as if they were concatenated in argument order
+Files are handed out to up to options->threads workers, each reads, parses and sorts whole files
+into their own store, then the sorted files are k-way merged into every target
+Threads left over when there are fewer files than threads are used inside each file
+Every file is read up to its own first empty line, line numbers in errors count from the start
+of their file. In ON_ERROR_EXIT mode the first bad line of the first file with one is reported
+with output_error(), otherwise the bad lines of every file are added to errors in file order
+Unless aggregates is NULL the students of every file are counted in it
+*/
+static void sort_input_files(char **paths, int file_count, FILE *output_fp, const OutputTarget *targets,
+                      int target_count, RunOptions *options, ErrorLog *errors, Aggregates *aggregates) {
+    InputPool pool = {0};
+    pool.files = (InputFile *) check_allocation(calloc(file_count, sizeof(InputFile)));
+    int worker_count = options->threads < file_count ? options->threads : file_count;
+    pthread_t *workers = (pthread_t *) check_allocation(malloc(sizeof(pthread_t) * worker_count));
+    int *started = (int *) check_allocation(calloc(worker_count, sizeof(int)));
+    pool.file_count = file_count;
+    pool.options = *options;
+    pool.options.threads = options->threads / worker_count;
+    pool.options.error_mode = ON_ERROR_SKIP; // Decided below once every file is done
+    for (int i = 0; i < file_count; i++) {
+        pool.files[i].path = paths[i];
+        if (aggregates == NULL) continue;
+        pool.files[i].aggregates = (Aggregates *) check_allocation(calloc(1, sizeof(Aggregates)));
+    }
+
+    // Reading, parsing and sorting overlap across files, so they are timed as one phase
+    stats_begin(PHASE_PARSE);
+    for (int w = 1; w < worker_count; w++) {
+        started[w] = pthread_create(&workers[w], NULL, input_pool_task, &pool) == 0;
+    }
+    input_pool_task(&pool); // This thread takes files too, including any a failed worker would have
+    for (int w = 1; w < worker_count; w++) {
+        if (started[w]) pthread_join(workers[w], NULL);
+    }
+    stats_end(PHASE_PARSE);
+    free(workers);
+    free(started);
+
+    for (int i = 0; i < file_count; i++) {
+        if (!pool.files[i].opened) output_error(output_fp, "Cannot open input file");
+        if (pool.files[i].empty) output_error(output_fp, "Empty input file");
+        exit_on_sort_mismatch(pool.files[i].verified);
+    }
+    for (int i = 0; i < file_count; i++) {
+        InputFile *file = &pool.files[i];
+        if (options->error_mode == ON_ERROR_EXIT && file->errors.count > 0) {
+            output_error(output_fp, file->errors.errors[0].message);
+        }
+        run_stats.bytes_read += file->bytes_read;
+        run_stats.lines += file->line_count;
+        run_stats.records += file->store.count;
+        error_log_append(errors, &file->errors);
+        if (aggregates != NULL) aggregate_merge(aggregates, file->aggregates);
+    }
+
+    // A complete error report replaces the sorted output
+    if (options->error_mode != ON_ERROR_REPORT || errors->count == 0) {
+        stats_begin(PHASE_OUTPUT);
+        merge_input_files(pool.files, file_count, targets, target_count);
+        stats_end(PHASE_OUTPUT);
+    }
+
+    for (int i = 0; i < file_count; i++) {
+        InputFile *file = &pool.files[i];
+        free(file->lines);
+        free(file->order);
+        store_free(&file->store);
+        arena_release(&file->arena);
+        unmap_input(&file->mapped);
+        free(file->aggregates);
+    }
+    free(pool.files);
+}
+
+/*
+Writes count elements of element_size and pads to the next 8 byte boundary
+Returns 0 on a write error
+*/
+static int write_section(FILE *fp, const void *data, size_t element_size, int64_t count) {
+    static const char padding[8] = {0};
+    size_t size = element_size * (size_t) count;
+    size_t padded = (size + 7) & ~(size_t) 7;
+    if (size > 0 && fwrite(data, size, 1, fp) != 1) return 0;
+    if (padded > size && fwrite(padding, padded - size, 1, fp) != 1) return 0;
+    return 1;
+}
+
+/*
+Writes the sorted students to fp as a snapshot, see SnapshotHeader
+The columns are gathered in option 3 order one at a time
+Returns 0 on a write error
+*/
+static int save_snapshot(FILE *fp, const StudentStore *store, const Partitions *partitions) {
+    int *order = merge_partitions(store, partitions);
+    int count = partitions->domestic_count + partitions->international_count;
+    int n = count > 0 ? count : 1;
+    int32_t *ints = (int32_t *) check_allocation(malloc(sizeof(int32_t) * n));
+    int16_t *shorts = (int16_t *) check_allocation(malloc(sizeof(int16_t) * n));
+    int64_t *offsets = (int64_t *) check_allocation(malloc(sizeof(int64_t) * n));
+    int32_t *domestic_rows = (int32_t *) check_allocation(malloc(sizeof(int32_t) * n));
+    int32_t *international_rows = (int32_t *) check_allocation(malloc(sizeof(int32_t) * n));
+
+    // Section sizes are known up front, so the header is written first
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.count = count;
+    header.domestic_count = partitions->domestic_count;
+    int64_t aligned_ints = ((int64_t) sizeof(int32_t) * count + 7) & ~(int64_t) 7;
+    int64_t aligned_shorts = ((int64_t) sizeof(int16_t) * count + 7) & ~(int64_t) 7;
+    int64_t aligned_domestic = ((int64_t) sizeof(int32_t) * partitions->domestic_count + 7) & ~(int64_t) 7;
+    int64_t aligned_international = ((int64_t) sizeof(int32_t) * partitions->international_count + 7) & ~(int64_t) 7;
+    header.birth_dates = sizeof(SnapshotHeader);
+    header.gpas = header.birth_dates + aligned_ints;
+    header.statuses = header.gpas + aligned_shorts;
+    header.text_lengths = header.statuses + aligned_shorts;
+    header.text_offsets = header.text_lengths + aligned_ints;
+    header.name_key_offsets = header.text_offsets + (int64_t) sizeof(int64_t) * count;
+    header.domestic_rows = header.name_key_offsets + (int64_t) sizeof(int64_t) * count;
+    header.international_rows = header.domestic_rows + aligned_domestic;
+    header.strings = header.international_rows + aligned_international;
+    for (int i = 0; i < count; i++) {
+        const char *name_key = store->name_key[order[i]];
+        size_t last_length = strlen(name_key) + 1;
+        header.strings_size += store->text_length[order[i]] + 1 + last_length + strlen(name_key + last_length) + 1;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    for (int i = 0; i < count; i++) ints[i] = store->birth_date[order[i]];
+    ok = ok && write_section(fp, ints, sizeof(int32_t), count);
+    for (int i = 0; i < count; i++) shorts[i] = store->gpa[order[i]];
+    ok = ok && write_section(fp, shorts, sizeof(int16_t), count);
+    for (int i = 0; i < count; i++) shorts[i] = store->status[order[i]];
+    ok = ok && write_section(fp, shorts, sizeof(int16_t), count);
+    for (int i = 0; i < count; i++) ints[i] = store->text_length[order[i]];
+    ok = ok && write_section(fp, ints, sizeof(int32_t), count);
+
+    // Each row's text is followed by its name key in the string table
+    int64_t string_offset = 0;
+    for (int i = 0; i < count; i++) {
+        offsets[i] = string_offset;
+        const char *name_key = store->name_key[order[i]];
+        size_t last_length = strlen(name_key) + 1;
+        string_offset += store->text_length[order[i]] + 1 + last_length + strlen(name_key + last_length) + 1;
+    }
+    ok = ok && write_section(fp, offsets, sizeof(int64_t), count);
+    for (int i = 0; i < count; i++) offsets[i] += store->text_length[order[i]] + 1;
+    ok = ok && write_section(fp, offsets, sizeof(int64_t), count);
+
+    int domestic_count = 0, international_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (store->type[order[i]] == DOMESTIC) {
+            domestic_rows[domestic_count++] = i;
+        } else {
+            international_rows[international_count++] = i;
+        }
+    }
+    ok = ok && write_section(fp, domestic_rows, sizeof(int32_t), domestic_count);
+    ok = ok && write_section(fp, international_rows, sizeof(int32_t), international_count);
+
+    for (int i = 0; ok && i < count; i++) {
+        const char *name_key = store->name_key[order[i]];
+        size_t last_length = strlen(name_key) + 1;
+        ok = fwrite(store->text[order[i]], store->text_length[order[i]] + 1, 1, fp) == 1 &&
+             fwrite(name_key, last_length + strlen(name_key + last_length) + 1, 1, fp) == 1;
+    }
+
+    free(order);
+    free(ints);
+    free(shorts);
+    free(offsets);
+    free(domestic_rows);
+    free(international_rows);
+    return ok && fflush(fp) == 0;
+}
+
+/*
+Returns 1 if the section of count elements of element_size lies inside the mapping, aligned
+*/
+static int snapshot_section_ok(const MappedInput *mapped, int64_t offset, size_t element_size, int64_t count) {
+    if (offset < (int64_t) sizeof(SnapshotHeader) || offset % 8 != 0 || count < 0) return 0;
+    if ((uint64_t) offset > mapped->size) return 0;
+    return (uint64_t) count <= (mapped->size - (uint64_t) offset) / element_size;
+}
+
+/*
+Maps the snapshot at path read only and checks its header
+Returns NULL on failure with *error set to SNAPSHOT_OPEN_FAILED or SNAPSHOT_INVALID
+Only the header is looked at, so opening takes the same time for any snapshot size
+*/
+static const SnapshotHeader* open_snapshot(const char *path, MappedInput *mapped, const char **error) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        *error = SNAPSHOT_OPEN_FAILED;
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+        fclose(fp);
+        *error = SNAPSHOT_INVALID;
+        return NULL;
+    }
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    fclose(fp);
+    if (data == MAP_FAILED) {
+        *error = SNAPSHOT_OPEN_FAILED;
+        return NULL;
+    }
+    mapped->data = data;
+    mapped->size = st.st_size;
+    mapped->mapped_size = st.st_size;
+
+    const SnapshotHeader *header = (const SnapshotHeader *) data;
+    int64_t count = header->count;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || count < 0 || count > INT32_MAX ||
+        header->domestic_count < 0 || header->domestic_count > count ||
+        !snapshot_section_ok(mapped, header->birth_dates, sizeof(int32_t), count) ||
+        !snapshot_section_ok(mapped, header->gpas, sizeof(int16_t), count) ||
+        !snapshot_section_ok(mapped, header->statuses, sizeof(int16_t), count) ||
+        !snapshot_section_ok(mapped, header->text_lengths, sizeof(int32_t), count) ||
+        !snapshot_section_ok(mapped, header->text_offsets, sizeof(int64_t), count) ||
+        !snapshot_section_ok(mapped, header->name_key_offsets, sizeof(int64_t), count) ||
+        !snapshot_section_ok(mapped, header->domestic_rows, sizeof(int32_t), header->domestic_count) ||
+        !snapshot_section_ok(mapped, header->international_rows, sizeof(int32_t), count - header->domestic_count) ||
+        !snapshot_section_ok(mapped, header->strings, 1, header->strings_size)) {
+        unmap_input(mapped);
+        *error = SNAPSHOT_INVALID;
+        return NULL;
+    }
+    return header;
+}
+
+/*
+Returns the text of snapshot row, or NULL if the row or its text runs outside the string table
+*/
+static const char* snapshot_text(const MappedInput *mapped, const SnapshotHeader *header, int64_t row) {
+    if (row < 0 || row >= header->count) return NULL;
+    int64_t offset = ((const int64_t *) (mapped->data + header->text_offsets))[row];
+    int32_t length = ((const int32_t *) (mapped->data + header->text_lengths))[row];
+    if (offset < 0 || length < 0 || offset >= header->strings_size || length >= header->strings_size - offset) {
+        return NULL;
+    }
+    const char *text = mapped->data + header->strings + offset;
+    return text[length] == '\0' ? text : NULL;
+}
+
+/*
+Writes every target straight from a mapped snapshot, nothing is parsed, validated or allocated
+per record, so the time taken follows the size of the output
+The filter is checked on the key columns
+*/
+static void emit_snapshot(const MappedInput *mapped, const SnapshotHeader *header, const OutputTarget *targets,
+                   int target_count, const RecordFilter *filter, FILE *output_fp) {
+    const int32_t *birth_dates = (const int32_t *) (mapped->data + header->birth_dates);
+    const int16_t *gpas = (const int16_t *) (mapped->data + header->gpas);
+    const int16_t *statuses = (const int16_t *) (mapped->data + header->statuses);
+    const int32_t *lengths = (const int32_t *) (mapped->data + header->text_lengths);
+    for (int t = 0; t < target_count; t++) {
+        const int32_t *rows = NULL;
+        int64_t count = header->count;
+        if (targets[t].option == 1) {
+            rows = (const int32_t *) (mapped->data + header->domestic_rows);
+            count = header->domestic_count;
+        } else if (targets[t].option == 2) {
+            rows = (const int32_t *) (mapped->data + header->international_rows);
+            count -= header->domestic_count;
+        }
+
+        OutputWriter writer;
+        writer_init(&writer, targets[t].fp);
+        for (int64_t i = 0; i < count; i++) {
+            int64_t row = rows != NULL ? rows[i] : i;
+            const char *text = snapshot_text(mapped, header, row);
+            if (text == NULL) output_error(output_fp, SNAPSHOT_INVALID);
+            if (!filter_accepts(filter, birth_dates[row] / 10000, gpas[row], statuses[row])) continue;
+            output_text(&writer, text, lengths[row]);
+        }
+        exit_on_write_error(writer_finish(&writer));
+    }
+}
+
+/*
+Copies the students of a mapped snapshot that pass filter into new rows of store, in their
+sorted order
+The strings stay views into the mapping, which must outlive the store
+Returns 0 if a row's strings run outside the string table or it holds a value no valid line could
+*/
+static int load_snapshot(const MappedInput *mapped, const SnapshotHeader *header, StudentStore *store,
+                  const RecordFilter *filter) {
+    const int32_t *birth_dates = (const int32_t *) (mapped->data + header->birth_dates);
+    const int16_t *gpas = (const int16_t *) (mapped->data + header->gpas);
+    const int16_t *statuses = (const int16_t *) (mapped->data + header->statuses);
+    const int32_t *lengths = (const int32_t *) (mapped->data + header->text_lengths);
+    const int64_t *key_offsets = (const int64_t *) (mapped->data + header->name_key_offsets);
+    const char *strings = mapped->data + header->strings;
+
+    store_reserve(store, store->count + (int) header->count);
+    for (int64_t i = 0; i < header->count; i++) {
+        const char *text = snapshot_text(mapped, header, i);
+        int64_t key_offset = key_offsets[i];
+        if (text == NULL || key_offset < 0 || key_offset >= header->strings_size) return 0;
+        // The name key holds two strings, both must end inside the table
+        const char *last_end = memchr(strings + key_offset, '\0', header->strings_size - key_offset);
+        if (last_end == NULL || memchr(last_end + 1, '\0', strings + header->strings_size - last_end - 1) == NULL) {
+            return 0;
+        }
+        // Rows are trusted like validated lines from here on, so values no line could hold are rejected
+        int year = birth_dates[i] / 10000;
+        if (year < 1950 || year > 2010 || gpas[i] < 0 || gpas[i] > 4300 || statuses[i] < -1 || statuses[i] > 120) {
+            return 0;
+        }
+        if (!filter_accepts(filter, year, gpas[i], statuses[i])) continue;
+
+        int row = store->count++;
+        store->birth_date[row] = birth_dates[i];
+        store->gpa[row] = gpas[i];
+        store->status[row] = statuses[i];
+        store->type[row] = statuses[i] < 0 ? DOMESTIC : INTERNATIONAL;
+        store->text[row] = (char *) text;
+        store->text_length[row] = lengths[i];
+        store->name_key[row] = (char *) (strings + key_offset);
+    }
+    return 1;
+}
+
+/*
+Reads the optional flags, first_flag is the index of the first one after the positional arguments
+Returns 0 on an unknown flag
+*/
+static int parse_flags(int argc, char **argv, int first_flag, RunOptions *options) {
+    for (int i = first_flag; i < argc; i++) {
+        if (strcmp(argv[i], "--zero-copy") == 0) {
+            options->zero_copy = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options->threads = atoi(argv[++i]);
+            if (options->threads < 1) return 0;
+        } else if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "merge") == 0) {
+                options->sort_engine = SORT_MERGE;
+            } else if (strcmp(argv[i], "radix") == 0) {
+                options->sort_engine = SORT_RADIX;
+            } else if (strcmp(argv[i], "adaptive") == 0) {
+                options->sort_engine = SORT_ADAPTIVE;
             } else {
-                return -1;
+                return 0;
             }
-        } else if (a_birth_month > b_birth_month) {
-            return 1;
+        } else if (strcmp(argv[i], "--verify-sort") == 0) {
+            options->verify_sort = 1;
+        } else if (strcmp(argv[i], "--on-error") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "exit") == 0) {
+                options->error_mode = ON_ERROR_EXIT;
+            } else if (strcmp(argv[i], "skip") == 0) {
+                options->error_mode = ON_ERROR_SKIP;
+            } else if (strcmp(argv[i], "report") == 0) {
+                options->error_mode = ON_ERROR_REPORT;
+            } else {
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--emit") == 0 && i + 1 < argc) {
+            // --emit <option>=<path>, one extra output per option
+            char *spec = argv[++i];
+            if (spec[0] < '1' || spec[0] > '3' || spec[1] != '=' || spec[2] == '\0') return 0;
+            options->extra_outputs[spec[0] - '1'] = spec + 2;
+        } else if (strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+            int megabytes = atoi(argv[++i]);
+            if (megabytes < 1) return 0;
+            options->memory_budget = (size_t) megabytes << 20;
+        } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            options->limit = atoi(argv[++i]);
+            if (options->limit < 1) return 0;
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            options->snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc) {
+            options->save_snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--min-gpa") == 0 && i + 1 < argc) {
+            char *end;
+            double gpa = strtod(argv[++i], &end);
+            if (*end != '\0' || end == argv[i] || gpa < 0) return 0;
+            options->filter.min_gpa = (int) (gpa * 1000 + 0.5);
+            options->filter.active = 1;
+        } else if (strcmp(argv[i], "--min-year") == 0 && i + 1 < argc) {
+            options->filter.min_year = atoi(argv[++i]);
+            options->filter.active = 1;
+        } else if (strcmp(argv[i], "--max-year") == 0 && i + 1 < argc) {
+            options->filter.max_year = atoi(argv[++i]);
+            options->filter.active = 1;
+        } else if (strcmp(argv[i], "--min-toefl") == 0 && i + 1 < argc) {
+            options->filter.min_toefl = atoi(argv[++i]);
+            if (options->filter.min_toefl < 0) return 0;
+            options->filter.active = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            options->stats = 1;
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            options->stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--aggregate") == 0 && i + 1 < argc) {
+            options->aggregate_path = argv[++i];
         } else {
-            return -1;
+            return 0;
         }
-    } else if (a_birth_year > b_birth_year) {
-        return 1;
+    }
+    // Snapshots are read and written by the in-memory sort only
+    int snapshots = options->snapshot_path != NULL || options->save_snapshot_path != NULL;
+    if (snapshots && (options->limit > 0 || options->memory_budget > 0)) return 0;
+    return 1;
+}
+
+/*
+Settings of a run without any flags
+*/
+static void default_options(RunOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->threads = 1;
+    options->filter.max_year = INT_MAX;
+    options->filter.min_toefl = -1;
+}
+
+A2Context* a2_context_create(void) {
+    pthread_once(&line_classifier_once, select_line_classifier);
+    A2Context *context = (A2Context *) calloc(1, sizeof(A2Context));
+    if (context == NULL) return NULL;
+    default_options(&context->options);
+    return context;
+}
+
+void a2_reset(A2Context *context) {
+    for (int i = 0; i < context->mapping_count; i++) {
+        unmap_input(&context->mappings[i]);
+    }
+    context->mapping_count = 0;
+    arena_reset(&context->arena);
+    context->store.count = 0;
+    context->sorted_rows = 0;
+    context->errors.count = 0;
+    free_partitions(&context->partitions);
+    free(context->combined);
+    context->combined = NULL;
+    context->sorted = 0;
+    context->stopped = 0;
+    context->message = NULL;
+    memset(&context->aggregates, 0, sizeof(context->aggregates));
+}
+
+void a2_context_free(A2Context *context) {
+    if (context == NULL) return;
+    a2_reset(context);
+    free(context->mappings);
+    store_free(&context->store);
+    arena_release(&context->arena);
+    error_log_free(&context->errors);
+    free(context);
+}
+
+/*
+Records why the current call of a job failed and returns its status
+*/
+static A2Status a2_fail(A2Context *context, A2Status status, const char *message) {
+    context->message = message;
+    return status;
+}
+
+/*
+Settings go through parse_flags() so they read exactly like the command line
+Flags of the command line outputs and streaming modes are refused, except --aggregate without
+its path, which only turns on counting for a2_write_aggregates()
+*/
+A2Status a2_set(A2Context *context, const char *flag, const char *value) {
+    if (strcmp(flag, "--aggregate") == 0 && value == NULL) {
+        context->aggregate = 1;
+        return A2_OK;
+    }
+    const char *job_flags[] = {"--zero-copy", "--threads", "--sort", "--verify-sort", "--on-error",
+                               "--min-gpa", "--min-year", "--max-year", "--min-toefl"};
+    int known = 0;
+    for (size_t i = 0; i < sizeof(job_flags) / sizeof(job_flags[0]); i++) {
+        if (strcmp(flag, job_flags[i]) == 0) known = 1;
+    }
+
+    // Parsed into a copy, so a bad value leaves the settings as they were
+    RunOptions options = context->options;
+    char *argv[2] = {(char *) flag, (char *) value};
+    if (!known || !parse_flags(value != NULL ? 2 : 1, argv, 0, &options)) {
+        return a2_fail(context, A2_ERROR_ARGUMENT, "Unknown setting");
+    }
+    context->options = options;
+    return A2_OK;
+}
+
+/*
+Keeps an input mapped until the job is reset, its students point into it
+*/
+static void a2_keep_mapping(A2Context *context, const MappedInput *mapped) {
+    if (context->mapping_count >= context->mapping_capacity) {
+        context->mapping_capacity = context->mapping_capacity == 0 ? INITIAL_MALLOC : context->mapping_capacity * 2;
+        size_t size = sizeof(MappedInput) * context->mapping_capacity;
+        context->mappings = check_allocation(realloc(context->mappings, size));
+    }
+    context->mappings[context->mapping_count++] = *mapped;
+}
+
+/*
+Parses the lines of one load into the job and frees the line array
+Bad lines fail the load unless they are skipped
+*/
+static A2Status a2_parse_lines(A2Context *context, char **lines, int line_count, size_t bytes_read) {
+    int first_row = context->store.count;
+    int first_error = context->errors.count;
+    stats_begin(PHASE_PARSE);
+    generate_students_from_lines(lines, line_count, &context->store, &context->arena, &context->options,
+                                 &context->errors, context->aggregate ? &context->aggregates : NULL);
+    stats_end(PHASE_PARSE);
+    free(lines);
+    if (run_stats.enabled) run_stats.bytes_read += bytes_read;
+    stats_add(&run_stats.lines, line_count);
+    stats_add(&run_stats.records, context->store.count - first_row);
+
+    context->sorted = 0;
+    if (context->errors.count > first_error && context->options.error_mode != ON_ERROR_SKIP) {
+        context->stopped = context->options.error_mode == ON_ERROR_EXIT;
+        return a2_fail(context, A2_ERROR_INVALID_RECORD, context->errors.errors[first_error].message);
+    }
+    return A2_OK;
+}
+
+/*
+Maps fp when possible, otherwise reads it line by line into the job's arena
+*/
+A2Status a2_load_stream(A2Context *context, FILE *fp) {
+    if (context->stopped) return a2_fail(context, A2_ERROR_ARGUMENT, A2_STOPPED);
+    MappedInput mapped = {0};
+    char **lines;
+    int line_count = 0;
+    size_t bytes_read;
+    stats_begin(PHASE_READ);
+    if (map_input(fp, &mapped)) {
+        a2_keep_mapping(context, &mapped);
+        lines = split_mapped_lines(&mapped, &line_count);
+        bytes_read = mapped.size;
+    } else {
+        lines = read_lines(fp, &line_count, &bytes_read, &context->arena);
+    }
+    stats_end(PHASE_READ);
+    return a2_parse_lines(context, lines, line_count, bytes_read);
+}
+
+A2Status a2_load_file(A2Context *context, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return a2_fail(context, A2_ERROR_OPEN, "Cannot open input file");
+    A2Status status = a2_load_stream(context, fp);
+    fclose(fp);
+    return status;
+}
+
+A2Status a2_load_buffer(A2Context *context, const char *data, size_t size) {
+    if (context->stopped) return a2_fail(context, A2_ERROR_ARGUMENT, A2_STOPPED);
+    // Lines are terminated in place, like a mapped input
+    char *copy = (char *) arena_alloc(&context->arena, size + 1);
+    memcpy(copy, data, size);
+    copy[size] = '\0';
+    MappedInput view = {copy, size, 0};
+    int line_count = 0;
+    char **lines = split_mapped_lines(&view, &line_count);
+    return a2_parse_lines(context, lines, line_count, size);
+}
+
+A2Status a2_load_snapshot(A2Context *context, const char *path) {
+    if (context->stopped) return a2_fail(context, A2_ERROR_ARGUMENT, A2_STOPPED);
+    if (context->store.count > 0) return a2_fail(context, A2_ERROR_ARGUMENT, "A snapshot must be loaded first");
+
+    MappedInput mapped = {0};
+    const char *error;
+    stats_begin(PHASE_READ);
+    const SnapshotHeader *header = open_snapshot(path, &mapped, &error);
+    int loaded = header != NULL && load_snapshot(&mapped, header, &context->store, &context->options.filter);
+    stats_end(PHASE_READ);
+    if (header == NULL) {
+        return a2_fail(context, error == SNAPSHOT_OPEN_FAILED ? A2_ERROR_OPEN : A2_ERROR_INVALID_SNAPSHOT, error);
+    }
+    a2_keep_mapping(context, &mapped);
+    if (!loaded) {
+        context->store.count = 0;
+        return a2_fail(context, A2_ERROR_INVALID_SNAPSHOT, SNAPSHOT_INVALID);
+    }
+    context->sorted_rows = context->store.count;
+    context->sorted = 0;
+    for (int row = 0; context->aggregate && row < context->store.count; row++) {
+        aggregate_student(&context->aggregates, &context->store, row);
+    }
+    return A2_OK;
+}
+
+A2Status a2_sort(A2Context *context) {
+    if (context->stopped) return a2_fail(context, A2_ERROR_ARGUMENT, A2_STOPPED);
+    stats_begin(PHASE_SORT);
+    free_partitions(&context->partitions);
+    free(context->combined);
+    context->combined = NULL;
+    partition_students(&context->store, &context->partitions);
+    int verified = sort_appended_partitions(&context->store, &context->partitions, context->sorted_rows,
+                                            &context->options);
+    stats_end(PHASE_SORT);
+    if (!verified) return a2_fail(context, A2_ERROR_VERIFY, "Sort verification failed");
+    context->sorted = 1;
+    return A2_OK;
+}
+
+A2Status a2_write(A2Context *context, int option, FILE *fp) {
+    if (option < 1 || option > 3) {
+        return a2_fail(context, A2_ERROR_ARGUMENT, "<option> must be an intger between 1 and 3 (inclusive)");
+    }
+    if (context->stopped) return a2_fail(context, A2_ERROR_ARGUMENT, A2_STOPPED);
+    if (!context->sorted) return a2_fail(context, A2_ERROR_ARGUMENT, "Students must be sorted before writing");
+
+    Partitions *partitions = &context->partitions;
+    const int *order = partitions->domestic;
+    int count = partitions->domestic_count;
+    if (option == 2) {
+        order = partitions->international;
+        count = partitions->international_count;
+    } else if (option == 3) {
+        if (context->combined == NULL) context->combined = merge_partitions(&context->store, partitions);
+        order = context->combined;
+        count = partitions->domestic_count + partitions->international_count;
+    }
+    stats_begin(PHASE_OUTPUT);
+    int written = output_students(fp, &context->store, order, count);
+    stats_end(PHASE_OUTPUT);
+    return written ? A2_OK : a2_fail(context, A2_ERROR_WRITE, "Cannot write output file");
+}
+
+A2Status a2_save_snapshot(A2Context *context, FILE *fp) {
+    if (context->stopped) return a2_fail(context, A2_ERROR_ARGUMENT, A2_STOPPED);
+    if (!context->sorted) return a2_fail(context, A2_ERROR_ARGUMENT, "Students must be sorted before writing");
+    stats_begin(PHASE_OUTPUT);
+    int written = save_snapshot(fp, &context->store, &context->partitions);
+    stats_end(PHASE_OUTPUT);
+    return written ? A2_OK : a2_fail(context, A2_ERROR_WRITE, "Cannot write snapshot file");
+}
+
+int a2_student_count(const A2Context *context) {
+    return context->store.count;
+}
+
+int a2_error_count(const A2Context *context) {
+    return context->errors.count;
+}
+
+A2Status a2_write_aggregates(A2Context *context, FILE *fp) {
+    if (context->stopped) return a2_fail(context, A2_ERROR_ARGUMENT, A2_STOPPED);
+    if (!context->aggregate) return a2_fail(context, A2_ERROR_ARGUMENT, "Aggregates must be turned on before loading");
+    write_aggregates_json(fp, &context->aggregates);
+    return ferror(fp) ? a2_fail(context, A2_ERROR_WRITE, "Cannot write aggregate file") : A2_OK;
+}
+
+void a2_write_errors(const A2Context *context, FILE *fp) {
+    write_error_report(fp, &context->errors);
+}
+
+const char* a2_error_message(const A2Context *context) {
+    return context->message;
+}
+
+/*
+Sorts input_path into output_path like the command line with those arguments would
+The output gets the sorted students, the error report, or the same "ERROR: ..." line
+Returns NULL on success, otherwise the message for the client
+*/
+static const char* serve_sort(A2Context *context, const char *input_path, const char *output_path, int option) {
+    FILE *output_fp = fopen(output_path, "w");
+    if (output_fp == NULL) return "Cannot open output file";
+
+    const char *error = NULL;
+    int reported = 0; // The output holds an error report instead of one error
+    FILE *input_fp = fopen(input_path, "r");
+    int first = input_fp != NULL ? fgetc(input_fp) : EOF;
+    if (input_fp == NULL) {
+        error = "Cannot open input file";
+    } else if (option < 1 || option > 3) {
+        error = "<option> must be an intger between 1 and 3 (inclusive)";
+    } else if (first == EOF) {
+        error = "Empty input file";
     } else {
-        return -1;
+        ungetc(first, input_fp);
+        A2Status status = a2_load_stream(context, input_fp);
+        if (status != A2_OK && context->options.error_mode == ON_ERROR_EXIT) {
+            error = a2_error_message(context);
+        } else if (status != A2_OK) {
+            a2_write_errors(context, output_fp);
+            error = "Invalid lines, see the error report in the output";
+            reported = 1;
+        } else if (a2_sort(context) != A2_OK || a2_write(context, option, output_fp) != A2_OK) {
+            error = a2_error_message(context);
+        }
     }
+
+    if (error != NULL && !reported) fprintf(output_fp, "ERROR: %s\n", error);
+    if (input_fp != NULL) fclose(input_fp);
+    if (fclose(output_fp) != 0 && error == NULL) error = "Cannot write output file";
+    return error;
 }
 
 /*
-Takes student array and sorts it in place
+Runs one request "<input_file> <output_file> <option>" and writes its one line answer to reply
 */
-void merge(Student *student, int start, int mid, int end) {
-    int n1 = mid - start + 1;
-    int n2 = end - mid;
+static void serve_job(A2Context *context, const RunOptions *options, char *request, char *reply, size_t reply_size) {
+    double start = clock_seconds(CLOCK_MONOTONIC);
+    char *save;
+    char *input_path = strtok_r(request, " \t\r", &save);
+    char *output_path = strtok_r(NULL, " \t\r", &save);
+    char *option = strtok_r(NULL, " \t\r", &save);
+    if (option == NULL || strtok_r(NULL, " \t\r", &save) != NULL) {
+        snprintf(reply, reply_size, "ERROR Expected <input_file> <output_file> <option> 0.000\n");
+        return;
+    }
 
-    Student *left = (Student*)malloc(n1 * sizeof(Student));
-    Student *right = (Student*)malloc(n2 * sizeof(Student));
+    // The context keeps its buffers from the previous job
+    a2_reset(context);
+    context->options = *options;
+    context->options.threads = 1; // Jobs run in parallel across workers instead
+    const char *error = serve_sort(context, input_path, output_path, atoi(option));
+    double milliseconds = (clock_seconds(CLOCK_MONOTONIC) - start) * 1000;
+    if (error != NULL) {
+        snprintf(reply, reply_size, "ERROR %s %.3f\n", error, milliseconds);
+    } else {
+        snprintf(reply, reply_size, "OK %d %.3f\n", a2_student_count(context), milliseconds);
+    }
+    fprintf(stderr, "%s %s %s: %s", input_path, output_path, option, reply);
+}
 
-    for (int i = 0; i < n1; i++) {
-        left[i] = student[start + i];
+/*
+Answers every request of one client in order until it disconnects, then closes fd
+*/
+static void serve_connection(A2Context *context, const RunOptions *options, int fd) {
+    FILE *fp = fdopen(fd, "r");
+    if (fp == NULL) {
+        close(fd);
+        return;
     }
-    for (int j = 0; j < n2; j++) {
-        right[j] = student[mid + 1 + j];
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    char reply[256];
+    // getline() returns as soon as a request is complete, clients wait for each answer
+    while ((length = getline(&line, &line_capacity, fp)) > 0) {
+        if (line[length - 1] == '\n') line[--length] = '\0';
+        if (length == 0) continue;
+        serve_job(context, options, line, reply, sizeof(reply));
+        if (!write_all(fd, reply, strlen(reply))) break;
     }
+    free(line);
+    fclose(fp);
+}
 
-    int i = 0, j = 0, k = start;
-    while (i < n1 && j < n2) {
-        if (student_comparator(left[i], right[j]) <= 0) {
-            student[k++] = left[i++];
-        } else {
-            student[k++] = right[j++];
+static void* serve_worker(void *arg) {
+    Server *server = (Server *) arg;
+    A2Context *context = check_allocation(a2_context_create());
+    struct timeval idle = {SERVE_IDLE_SECONDS, 0};
+    struct timespec retry = {0, SERVE_RETRY_MS * 1000000L};
+    while (1) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // Out of descriptors or memory for now, the server keeps going once some are freed
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                perror("Failed to accept connection, retrying.");
+                nanosleep(&retry, NULL);
+                continue;
+            }
+            perror("Failed to accept connection.");
+            exit(EXIT_FAILURE);
         }
+        // Reads of an idle client time out, so silent clients can't hold every worker
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        serve_connection(context, &server->options, fd);
     }
+    return NULL;
+}
 
-    while (i < n1) {
-        student[k++] = left[i++];
+// Socket of the running server, removed by serve_shutdown()
+static const char *serve_socket_path;
+
+/*
+SIGINT and SIGTERM handler of the server, removes its socket before exiting
+*/
+static void serve_shutdown(int signal_number) {
+    (void) signal_number;
+    unlink(serve_socket_path);
+    _exit(0);
+}
+
+/*
+Serves sort jobs on a Unix domain socket at socket_path until the process is killed
+A client sends one request per line, "<input_file> <output_file> <option>", handled like the
+command line with those arguments and the flags the server was started with. Each request is
+answered with one line, "OK <students> <milliseconds>" or "ERROR <message> <milliseconds>",
+and logged the same way to stderr
+options->threads workers accept connections, each keeps one library context for all its jobs so
+buffers and arenas stay allocated between jobs. A client silent for SERVE_IDLE_SECONDS is
+disconnected
+A socket left at socket_path by an earlier server is replaced, any other file is left alone and
+fails the start. The socket is removed on SIGINT or SIGTERM
+Returns EXIT_FAILURE if the socket can't be set up
+*/
+static int serve(const char *socket_path, const RunOptions *options) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path is too long\n");
+        return EXIT_FAILURE;
     }
+    strcpy(address.sun_path, socket_path);
 
-    while (j < n2) {
-        student[k++] = right[j++];
+    struct stat existing;
+    if (lstat(socket_path, &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", socket_path);
+            return EXIT_FAILURE;
+        }
+        unlink(socket_path);
     }
 
-    free(left);
-    free(right);
+    Server server;
+    server.options = *options;
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.listen_fd == -1 || bind(server.listen_fd, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+        listen(server.listen_fd, SOMAXCONN) == -1) {
+        perror("Failed to open socket.");
+        return EXIT_FAILURE;
+    }
+    // A client that hangs up before its answer must not end the server
+    signal(SIGPIPE, SIG_IGN);
+    serve_socket_path = socket_path;
+    signal(SIGINT, serve_shutdown);
+    signal(SIGTERM, serve_shutdown);
+
+    // This thread is the last worker
+    for (int w = 1; w < options->threads; w++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, serve_worker, &server) == 0) pthread_detach(worker);
+    }
+    serve_worker(&server);
+    return 0;
 }
 
-void merge_sort(Student *student, int start, int end) {
-    if (start < end) {
-        int mid = start + (end - start) / 2;
-        merge_sort(student, start, mid);
-        merge_sort(student, mid + 1, end);
-        merge(student, start, mid, end);
+#ifndef A2_NO_MAIN
+/*
+Saves the sorted students of context as a snapshot at path for --save-snapshot
+The snapshot is written next to path and renamed over it once complete, so the snapshot being
+appended to may also be the one saved
+*/
+static void save_snapshot_file(A2Context *context, const char *path) {
+    char *temp_path = (char *) check_allocation(malloc(strlen(path) + 5));
+    sprintf(temp_path, "%s.tmp", path);
+    FILE *snapshot_fp = fopen(temp_path, "wb");
+    if (snapshot_fp == NULL) {
+        perror("Cannot open --save-snapshot output file.");
+        exit(EXIT_FAILURE);
+    }
+    if (a2_save_snapshot(context, snapshot_fp) != A2_OK || fclose(snapshot_fp) != 0) {
+        remove(temp_path);
+        perror("Failed to write snapshot.");
+        exit(EXIT_FAILURE);
     }
+    if (rename(temp_path, path) != 0) {
+        remove(temp_path);
+        perror("Failed to save snapshot.");
+        exit(EXIT_FAILURE);
+    }
+    free(temp_path);
 }
 
 int main(int argc, char **argv) {
@@ -598,15 +3883,53 @@ int main(int argc, char **argv) {
     fclose(a_num_fp);
 
     // Validating arguments
-    if (argc != 4) {
-        printf("Usage: %s <input_file> <a_num_fp> <option>\n", argv[0]);
+    RunOptions options;
+    default_options(&options);
+    pthread_once(&line_classifier_once, select_line_classifier);
+    if (argc >= 3 && strcmp(argv[1], "--serve") == 0) {
+        // Jobs name their own files, so only settings that apply to every job are taken
+        int job_flags_only = parse_flags(argc, argv, 3, &options) && options.limit == 0 &&
+                             options.memory_budget == 0 && options.snapshot_path == NULL &&
+                             options.save_snapshot_path == NULL && !options.stats && options.stats_path == NULL &&
+                             options.aggregate_path == NULL &&
+                             options.extra_outputs[0] == NULL && options.extra_outputs[1] == NULL &&
+                             options.extra_outputs[2] == NULL;
+        if (job_flags_only) return serve(argv[2], &options);
+    }
+    // Positional arguments run up to the first flag: the inputs, then the output and the option
+    int first_flag = 1;
+    while (first_flag < argc && strncmp(argv[first_flag], "--", 2) != 0) {
+        first_flag++;
+    }
+    int input_count = first_flag - 3;
+    int valid = input_count >= 1 && parse_flags(argc, argv, first_flag, &options);
+    // Several inputs are only sorted in memory
+    if (valid && input_count > 1 && (options.limit > 0 || options.memory_budget > 0 ||
+                                     options.snapshot_path != NULL || options.save_snapshot_path != NULL)) {
+        valid = 0;
+    }
+    if (!valid) {
+        printf("Usage: %s <input_file|-> [input_file ...] <a_num_fp|-> <option>"
+               " [--zero-copy] [--threads N] [--sort merge|radix|adaptive] [--verify-sort]"
+               " [--memory-budget MB] [--on-error exit|skip|report]"
+               " [--emit option=path] [--stats] [--stats-json path]"
+               " [--limit N] [--snapshot path] [--save-snapshot path]"
+               " [--min-gpa GPA] [--min-year YEAR] [--max-year YEAR] [--min-toefl SCORE]"
+               " [--aggregate path]\n"
+               "       %s --serve <socket>"
+               " [--threads N] [--zero-copy] [--sort ...] [--verify-sort] [--on-error ...]"
+               " [--min-gpa ...] [--min-year ...] [--max-year ...] [--min-toefl ...]\n", argv[0], argv[0]);
         return EXIT_FAILURE;
     }
 
-    FILE *input_fp = fopen(argv[1], "r"); // Input file
-    int size = 0; // Input size in bytes
+    // "-" reads stdin and writes stdout, so the tool can sit in a pipeline
+    // Several input files are opened by the file workers instead
+    FILE *input_fp = NULL; // Input file
+    if (input_count == 1) input_fp = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "r");
+    int empty = 0; // Input has no bytes at all
 
-    FILE *output_fp = fopen(argv[2], "w"); // Output file
+    char *output_path = argv[first_flag - 2];
+    FILE *output_fp = strcmp(output_path, "-") == 0 ? stdout : fopen(output_path, "w"); // Output file
 
     // Checks if files exist
     if (output_fp == NULL) {
@@ -614,73 +3937,136 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    if (input_fp == NULL) {
+    if (input_count == 1 && input_fp == NULL) {
         output_error(output_fp, "Cannot open input file");
     }
 
     // Validating option argument
-    int option = atoi(argv[3]);
+    int option = atoi(argv[first_flag - 1]);
     if (option < 1 || option > 3) {
         output_error(output_fp, "<option> must be an intger between 1 and 3 (inclusive)");
         return 1;
     }
 
-    // Checks if empty input file and assigns size
+    // Checks if empty input file by peeking at the first byte, which also works on pipes
     if (NULL != input_fp) {
-        fseek (input_fp, 0, SEEK_END);
-        size = ftell(input_fp);
-        if (0 == size) {
+        int first = fgetc(input_fp);
+        empty = first == EOF;
+        // Appending nothing to a snapshot is fine
+        if (empty && options.snapshot_path == NULL) {
             output_error(output_fp, "Empty input file");
         }
-        rewind(input_fp);
+        if (!empty) ungetc(first, input_fp);
     }
 
-    int line_count = 0;
-    char **lines = read_lines(input_fp, size, &line_count);
-    int student_count = 0;
-    Student *students = generate_students_from_lines(lines, line_count, &student_count, output_fp);
-    merge_sort(students, 0, student_count - 1);
-
-    // Output to file based on option
-    switch (option) {
-        case 1: {
-            output_domestic(output_fp, students, student_count);
-            break;
+    // The positional output plus any --emit outputs, all written from the same sort
+    OutputTarget targets[4] = {{option, output_fp}};
+    int target_count = 1;
+    for (int i = 0; i < 3; i++) {
+        if (options.extra_outputs[i] == NULL) continue;
+        FILE *extra_fp = fopen(options.extra_outputs[i], "w");
+        if (extra_fp == NULL) output_error(output_fp, "Cannot open --emit output file");
+        emit_fps[emit_fp_count++] = extra_fp;
+        targets[target_count].option = i + 1;
+        targets[target_count].fp = extra_fp;
+        target_count++;
+    }
+    // The --stats-json, --aggregate and --save-snapshot files are only created once the run got
+    // through, so a run ending on an error leaves none of them behind
+    run_stats.enabled = options.stats || options.stats_path != NULL;
+    Aggregates *aggregates = NULL; // Filled by whichever path sorts the input
+    if (options.aggregate_path != NULL) {
+        aggregates = (Aggregates *) check_allocation(calloc(1, sizeof(Aggregates)));
+    }
+
+    ErrorLog errors = {0};
+    if (input_count > 1) {
+        // Each file is sorted on its own and the sorted files are merged
+        sort_input_files(argv + 1, input_count, output_fp, targets, target_count, &options, &errors, aggregates);
+    } else if (options.limit > 0) {
+        // Only the first students are wanted, no need to hold or sort the rest
+        limit_sort(input_fp, output_fp, targets, target_count, &options, &errors, aggregates);
+    } else if (options.snapshot_path != NULL && empty && options.save_snapshot_path == NULL && aggregates == NULL) {
+        // Nothing to append, save or count: the snapshot is written out straight from its mapping
+        MappedInput snapshot = {0};
+        stats_begin(PHASE_READ);
+        const char *error;
+        const SnapshotHeader *header = open_snapshot(options.snapshot_path, &snapshot, &error);
+        if (header == NULL) output_error(output_fp, error);
+        stats_end(PHASE_READ);
+        stats_begin(PHASE_OUTPUT);
+        emit_snapshot(&snapshot, header, targets, target_count, &options.filter, output_fp);
+        stats_end(PHASE_OUTPUT);
+        run_stats.records = header->count;
+        unmap_input(&snapshot);
+    } else if (options.memory_budget > 0) {
+        // Inputs that may not fit in memory are sorted in runs and merged
+        external_sort(input_fp, output_fp, targets, target_count, &options, &errors, aggregates);
+    } else {
+        // The in-memory sort is one library job
+        A2Context *context = check_allocation(a2_context_create());
+        context->options = options;
+        context->aggregate = aggregates != NULL;
+        if (options.snapshot_path != NULL && a2_load_snapshot(context, options.snapshot_path) != A2_OK) {
+            output_error(output_fp, a2_error_message(context));
         }
-        case 2: {
-            output_international(output_fp, students, student_count);
-            break;
+        // New lines go after the snapshot, line numbers in errors count from the new input
+        if (a2_load_stream(context, input_fp) != A2_OK && options.error_mode == ON_ERROR_EXIT) {
+            output_error(output_fp, a2_error_message(context));
         }
-        case 3: {
-            output_both(output_fp, students, student_count);
-            break;
+
+        // A complete error report replaces the sorted output
+        if (options.error_mode != ON_ERROR_REPORT || a2_error_count(context) == 0) {
+            exit_on_sort_mismatch(a2_sort(context) == A2_OK);
+            for (int t = 0; t < target_count; t++) {
+                exit_on_write_error(a2_write(context, targets[t].option, targets[t].fp) == A2_OK);
+            }
+            if (options.save_snapshot_path != NULL) save_snapshot_file(context, options.save_snapshot_path);
         }
+
+        error_log_append(&errors, &context->errors);
+        if (aggregates != NULL) aggregate_merge(aggregates, &context->aggregates);
+        a2_context_free(context);
     }
 
-    // Free and close
-    for (int i = 0; i < line_count; i++) {
-        free(lines[i]);
-        Student student = students[i];
-        if (student.type == DOMESTIC) {
-            free(student.student.domestic.first_name);
-            free(student.student.domestic.last_name);
-            free(student.student.domestic.birth_year);
-            free(student.student.domestic.birth_month);
-            free(student.student.domestic.birth_day);
-            free(student.student.domestic.gpa_str);
-        } else {
-            free(student.student.international.first_name);
-            free(student.student.international.last_name);
-            free(student.student.international.birth_year);
-            free(student.student.international.birth_month);
-            free(student.student.international.birth_day);
-            free(student.student.international.gpa_str);
-            free(student.student.international.TOEFL_score);
+    // Bad lines collected instead of stopping at the first one
+    if (options.error_mode == ON_ERROR_SKIP) write_error_report(stderr, &errors);
+    if (options.error_mode == ON_ERROR_REPORT) {
+        // The report replaces every output
+        for (int t = 0; t < target_count; t++) {
+            write_error_report(targets[t].fp, &errors);
         }
     }
-    free(lines);
-    free(students);
-    fclose(input_fp);
+    int status = options.error_mode == ON_ERROR_REPORT && errors.count > 0 ? EXIT_FAILURE : 0;
+
+    if (options.stats) write_stats_text(stderr, errors.count);
+    if (options.stats_path != NULL) {
+        FILE *stats_fp = fopen(options.stats_path, "w");
+        if (stats_fp == NULL) {
+            perror("Cannot open --stats-json output file.");
+            exit(EXIT_FAILURE);
+        }
+        write_stats_json(stats_fp, errors.count);
+        fclose(stats_fp);
+    }
+    if (aggregates != NULL) {
+        FILE *aggregate_fp = fopen(options.aggregate_path, "w");
+        if (aggregate_fp == NULL) {
+            perror("Cannot open --aggregate output file.");
+            exit(EXIT_FAILURE);
+        }
+        write_aggregates_json(aggregate_fp, aggregates);
+        fclose(aggregate_fp);
+    }
+    free(aggregates);
+
+    // Free and close
+    error_log_free(&errors);
+    for (int i = 1; i < target_count; i++) {
+        fclose(targets[i].fp);
+    }
+    if (input_fp != NULL) fclose(input_fp);
     fclose(output_fp);
-    return 0;
-}
\ No newline at end of file
+    return status;
+}
+#endif
@@ -0,0 +1,100 @@
+/*
+Library interface of the student sorter, for programs that sort many rosters in one process
+a2.c without its command line is the library:
+    gcc -O2 -c -DA2_NO_MAIN a2.c -o a2.o
+    gcc -O2 service.c a2.o -o service -lpthread
+The functions below are the only symbols a2.o exports, everything else in a2.c is static
+
+An A2Context is one job: its settings, the students loaded so far and their sorted order
+Contexts share no state, so different threads may run jobs on their own contexts at the same
+time. One context must only be used by one thread at a time
+Failures are returned as an A2Status and never end the process, the message of the last one
+stays in the context. Only running out of memory still exits, as everywhere else in a2.c
+--stats timings and counters are process wide and only collected for the command line
+*/
+#ifndef A2_H
+#define A2_H
+
+#include<stdio.h>
+
+typedef enum {
+    A2_OK = 0,
+    A2_ERROR_ARGUMENT, // Unknown setting, option outside 1 to 3, or a call out of order
+    A2_ERROR_OPEN, // An input or snapshot file can't be opened
+    A2_ERROR_INVALID_RECORD, // Lines failed validation, see a2_write_errors()
+    A2_ERROR_INVALID_SNAPSHOT,
+    A2_ERROR_WRITE, // An output could not be written
+    A2_ERROR_VERIFY, // --verify-sort found the engine's order differs from the merge sort
+} A2Status;
+
+typedef struct A2Context A2Context;
+
+/*
+New job with the command line defaults, NULL if out of memory
+*/
+A2Context* a2_context_create(void);
+void a2_context_free(A2Context *context);
+
+/*
+Drops the students, errors and inputs of the job but keeps its settings and buffers, so the
+context can run the next job without allocating again
+*/
+void a2_reset(A2Context *context);
+
+/*
+Changes one setting with the command line flag and its value, NULL for flags without one
+Takes --zero-copy, --threads, --sort, --verify-sort, --on-error, --min-gpa, --min-year,
+--max-year and --min-toefl, and --aggregate without a path to count students for
+a2_write_aggregates()
+*/
+A2Status a2_set(A2Context *context, const char *flag, const char *value);
+
+/*
+Parse and validate lines into the job, after any students loaded before
+Reading stops at the first empty line, line numbers in errors count from the start of each load
+With --on-error exit (the default) parsing stops at the first bad line and keeps only the students
+before it, every later call but a2_reset() then fails with A2_ERROR_ARGUMENT. With report every
+bad line is collected and A2_ERROR_INVALID_RECORD returned, with skip bad lines are collected and
+left out
+a2_load_buffer() copies data, the others keep inputs mapped until the job is reset
+*/
+A2Status a2_load_file(A2Context *context, const char *path);
+A2Status a2_load_stream(A2Context *context, FILE *fp);
+A2Status a2_load_buffer(A2Context *context, const char *data, size_t size);
+
+/*
+Loads the students of a snapshot written by a2_save_snapshot() or --save-snapshot
+Only allowed as the first load of a job, its students are already in order and are not sorted
+again
+*/
+A2Status a2_load_snapshot(A2Context *context, const char *path);
+
+/*
+Sorts every student loaded so far, needed again after further loads
+With --verify-sort a result differing from the merge sort fails with A2_ERROR_VERIFY
+*/
+A2Status a2_sort(A2Context *context);
+
+/*
+Writes the sorted students of option 1 (domestic), 2 (international) or 3 (all) to fp
+*/
+A2Status a2_write(A2Context *context, int option, FILE *fp);
+A2Status a2_save_snapshot(A2Context *context, FILE *fp);
+
+/*
+Writes a JSON summary of every student loaded so far: counts by type, GPA percentiles and
+histogram, students per birth year and TOEFL percentiles. It is counted while parsing, so it
+needs no sort, but --aggregate must be set before the first load
+*/
+A2Status a2_write_aggregates(A2Context *context, FILE *fp);
+
+int a2_student_count(const A2Context *context);
+int a2_error_count(const A2Context *context);
+
+/*
+Writes one "ERROR: line N: message" line per collected bad line
+*/
+void a2_write_errors(const A2Context *context, FILE *fp);
+const char* a2_error_message(const A2Context *context);
+
+#endif
@@ -0,0 +1,249 @@
+/*
+End to end benchmark of the sorter on a synthetic roster
+Each stage is timed on its own: reading the lines, parsing them into students, sorting with
+every engine and writing the output
+
+Build and run from the repository root:
+    gcc -O2 bench.c -o bench -lpthread
+    ./bench [line_count] [international_percent] [invalid_percent] [threads] [seed] [displaced_percent]
+
+Defaults: 1000000 lines, 50% international, no invalid lines, 1 thread, seed 2510, 100% displaced
+displaced_percent below 100 writes a nearly sorted roster instead: the valid lines in sorted
+order with that share of them swapped to random places, the case the adaptive engine is for.
+Invalid lines are left out of it
+line_count may be anything from 1000 to 100000000, the roster is written to a temp file in the
+working directory and removed afterwards
+Invalid lines are skipped the same way as --on-error skip
+The same arguments always generate the same roster, so runs are comparable across builds
+*/
+#define A2_NO_MAIN
+#include "a2.c"
+
+#include<time.h>
+#include<sys/resource.h>
+
+/*
+Small deterministic generator so the benchmark needs no input file
+*/
+unsigned int bench_random(unsigned int *state) {
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 8) & 0xffffff;
+}
+
+/*
+Writes one line that fails validation, cycling through the kinds of format errors
+*/
+void write_invalid_line(FILE *fp, unsigned int *state) {
+    switch (bench_random(state) % 5) {
+        case 0:
+            fprintf(fp, "Ann Lee Foo-1-2000 3.5 D\n");
+            break;
+        case 1:
+            fprintf(fp, "Ann Lee Feb-30-2000 3.5 D\n");
+            break;
+        case 2:
+            fprintf(fp, "Ann Lee Jan-1-2000 4.9 D\n");
+            break;
+        case 3:
+            fprintf(fp, "Ann Lee Jan-1-2000 3.5 D 100\n");
+            break;
+        default:
+            fprintf(fp, "Ann Lee Jan-1-2000 3.5 I 121\n");
+            break;
+    }
+}
+
+/*
+Writes line_count roster lines to fp
+international_percent and invalid_percent pick the mix, names vary in case and length so
+the comparator sees realistic ties
+*/
+void generate_roster(FILE *fp, long line_count, int international_percent, int invalid_percent, unsigned int seed) {
+    const char *names[] = {"Ann", "bob", "Cy", "Dana", "eve", "Farid", "Grace", "Hiro", "Ines", "Jo",
+                           "Kim", "LEE", "Mateo", "Nadia", "Oscar", "Priya", "Quinn", "Ravi", "Sofia", "Tran"};
+    const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    unsigned int state = seed;
+
+    for (long i = 0; i < line_count; i++) {
+        if ((int) (bench_random(&state) % 100) < invalid_percent) {
+            write_invalid_line(fp, &state);
+            continue;
+        }
+        const char *first = names[bench_random(&state) % 20];
+        const char *last = names[bench_random(&state) % 20];
+        int month = bench_random(&state) % 12;
+        int day = 1 + bench_random(&state) % 28;
+        int year = 1950 + bench_random(&state) % 61;
+        int gpa = bench_random(&state) % 4301;
+        if ((int) (bench_random(&state) % 100) < international_percent) {
+            fprintf(fp, "%s %s %s-%d-%d %d.%03d I %d\n", first, last, months[month], day, year,
+                    gpa / 1000, gpa % 1000, bench_random(&state) % 121);
+        } else {
+            fprintf(fp, "%s %s %s-%d-%d %d.%03d D\n", first, last, months[month], day, year,
+                    gpa / 1000, gpa % 1000);
+        }
+    }
+}
+
+/*
+Rewrites the roster in fp in sorted order, then swaps displaced_percent of the lines with a random
+other line
+*/
+void presort_roster(FILE *fp, int displaced_percent, unsigned int seed) {
+    Arena arena = {0};
+    StudentStore store = {0};
+    ErrorLog errors = {0};
+    RunOptions options;
+    default_options(&options);
+    options.error_mode = ON_ERROR_SKIP;
+    int line_count = 0;
+    size_t bytes_read;
+    rewind(fp);
+    char **lines = read_lines(fp, &line_count, &bytes_read, &arena);
+    generate_students_from_lines(lines, line_count, &store, &arena, &options, &errors, NULL);
+
+    Partitions partitions;
+    partition_students(&store, &partitions);
+    sort_partitions(&store, &partitions, &options);
+    int *order = merge_partitions(&store, &partitions);
+    unsigned int state = seed;
+    for (int i = 0; i < store.count; i++) {
+        if ((int) (bench_random(&state) % 100) >= displaced_percent) continue;
+        int j = (int) (((unsigned long long) bench_random(&state) << 24 | bench_random(&state)) % store.count);
+        int temp = order[i];
+        order[i] = order[j];
+        order[j] = temp;
+    }
+
+    if (ftruncate(fileno(fp), 0) != 0 || lseek(fileno(fp), 0, SEEK_SET) != 0 ||
+        !output_students(fp, &store, order, store.count)) {
+        perror("Failed to write benchmark input.");
+        exit(EXIT_FAILURE);
+    }
+    free(order);
+    free_partitions(&partitions);
+    error_log_free(&errors);
+    store_free(&store);
+    free(lines);
+    arena_release(&arena);
+}
+
+double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+Peak resident set size of the process so far in megabytes
+*/
+double peak_rss_mb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+void report(const char *stage, double seconds, long rows) {
+    printf("%-24s %9.3f s %12.0f rows/s %9.1f MB peak RSS\n", stage, seconds, rows / seconds, peak_rss_mb());
+}
+
+int main(int argc, char **argv) {
+    long line_count = argc > 1 ? atol(argv[1]) : 1000000;
+    int international_percent = argc > 2 ? atoi(argv[2]) : 50;
+    int invalid_percent = argc > 3 ? atoi(argv[3]) : 0;
+    int threads = argc > 4 ? atoi(argv[4]) : 1;
+    unsigned int seed = argc > 5 ? (unsigned int) atol(argv[5]) : 2510;
+    int displaced_percent = argc > 6 ? atoi(argv[6]) : 100;
+    if (line_count < 1 || line_count > 100000000 || international_percent < 0 || international_percent > 100 ||
+        invalid_percent < 0 || invalid_percent > 100 || threads < 1 || displaced_percent < 0 ||
+        displaced_percent > 100) {
+        printf("Usage: %s [line_count] [international_percent] [invalid_percent] [threads] [seed] [displaced_percent]\n",
+               argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char path[] = "bench_input_XXXXXX";
+    int fd = mkstemp(path);
+    FILE *input_fp = fd == -1 ? NULL : fdopen(fd, "w+");
+    FILE *output_fp = fopen("/dev/null", "w");
+    if (input_fp == NULL || output_fp == NULL) {
+        perror("Failed to open benchmark files.");
+        return EXIT_FAILURE;
+    }
+
+    double start = seconds_now();
+    generate_roster(input_fp, line_count, international_percent, invalid_percent, seed);
+    fflush(input_fp);
+    if (displaced_percent < 100) presort_roster(input_fp, displaced_percent, seed);
+    long input_size = lseek(fd, 0, SEEK_END);
+    printf("%ld lines (%d%% international, %d%% invalid, %d%% displaced), %.1f MB, %d thread(s), seed %u\n",
+           line_count, international_percent, invalid_percent, displaced_percent, input_size / 1e6, threads, seed);
+    report("generate", seconds_now() - start, line_count);
+
+    // Reads the file once through stdio and once mapped, the parse uses the mapped lines like main
+    Arena read_arena = {0};
+    int read_count = 0;
+    rewind(input_fp);
+    start = seconds_now();
+    size_t bytes_read;
+    char **read = read_lines(input_fp, &read_count, &bytes_read, &read_arena);
+    report("read_lines", seconds_now() - start, read_count);
+    free(read);
+    arena_release(&read_arena);
+
+    MappedInput mapped = {0};
+    int mapped_count = 0;
+    start = seconds_now();
+    if (!map_input(input_fp, &mapped)) {
+        perror("Failed to map benchmark input.");
+        return EXIT_FAILURE;
+    }
+    char **lines = split_mapped_lines(&mapped, &mapped_count);
+    report("map + split", seconds_now() - start, mapped_count);
+
+    RunOptions options;
+    default_options(&options);
+    options.threads = threads;
+    options.error_mode = ON_ERROR_SKIP;
+    Arena arena = {0};
+    StudentStore store = {0};
+    ErrorLog errors = {0};
+    start = seconds_now();
+    generate_students_from_lines(lines, mapped_count, &store, &arena, &options, &errors, NULL);
+    report("parse", seconds_now() - start, mapped_count);
+    if (errors.count > 0) printf("%-24s %d lines skipped\n", "", errors.count);
+
+    // Every engine sorts the same fresh partitions, the last one is kept for the output stage
+    SortEngine engines[] = {SORT_MERGE, SORT_RADIX, SORT_ADAPTIVE};
+    const char *engine_names[] = {"sort (merge)", "sort (radix)", "sort (adaptive)"};
+    Partitions partitions;
+    for (int e = 0; e < 3; e++) {
+        partition_students(&store, &partitions);
+        options.sort_engine = engines[e];
+        start = seconds_now();
+        sort_partitions(&store, &partitions, &options);
+        report(engine_names[e], seconds_now() - start, store.count);
+        if (e < 2) free_partitions(&partitions);
+    }
+
+    for (int option = 1; option <= 3; option++) {
+        char stage[32];
+        sprintf(stage, "output (option %d)", option);
+        OutputTarget target = {option, output_fp};
+        start = seconds_now();
+        write_targets(&target, 1, &store, &partitions, 0);
+        report(stage, seconds_now() - start, option == 1 ? partitions.domestic_count :
+               option == 2 ? partitions.international_count : store.count);
+    }
+
+    free_partitions(&partitions);
+    error_log_free(&errors);
+    store_free(&store);
+    arena_release(&arena);
+    free(lines);
+    unmap_input(&mapped);
+    fclose(output_fp);
+    fclose(input_fp);
+    unlink(path);
+    return 0;
+}
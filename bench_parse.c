@@ -0,0 +1,147 @@
+/*
+Micro-benchmark of the record parser: the scalar reference parser against the vectorized
+fast path with every line classifier the CPU supports
+
+Build and run from the repository root:
+    gcc -O2 bench_parse.c -o bench_parse
+    ./bench_parse [line_count] [rounds]
+
+Lines are synthetic canonical records from a fixed seed, so runs are comparable
+Each round parses a fresh copy of the lines, only the parsing itself is timed
+*/
+#define A2_NO_MAIN
+#include "a2.c"
+
+#include<time.h>
+
+typedef const char* (*ParseFn)(char *line, StudentStore *store, int index, Arena *arena, int zero_copy,
+                               const RecordFilter *filter);
+
+/*
+Small deterministic generator so the benchmark needs no input file
+*/
+unsigned int bench_random(unsigned int *state) {
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 8) & 0xffffff;
+}
+
+/*
+Writes line_count valid records, each terminated by a null byte
+Returns the buffer, offsets receives the start of every line
+*/
+char* generate_lines(int line_count, size_t **offsets, size_t *buffer_size) {
+    const char *names[] = {"Ann", "bob", "Cy", "Dana", "eve", "Farid", "Grace", "Hiro", "Ines", "Jo"};
+    const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    unsigned int state = 2510;
+
+    char *buffer = (char *) malloc((size_t) line_count * 48);
+    *offsets = (size_t *) malloc(sizeof(size_t) * line_count);
+    if (buffer == NULL || *offsets == NULL) {
+        perror("Failed to allocate.");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t used = 0;
+    for (int i = 0; i < line_count; i++) {
+        (*offsets)[i] = used;
+        const char *first = names[bench_random(&state) % 10];
+        const char *last = names[bench_random(&state) % 10];
+        const char *month = months[bench_random(&state) % 12];
+        int day = 1 + bench_random(&state) % 28;
+        int year = 1950 + bench_random(&state) % 61;
+        int gpa = bench_random(&state) % 4301;
+        if (bench_random(&state) % 2) {
+            used += sprintf(buffer + used, "%s %s %s-%d-%d %d.%03d I %d", first, last, month, day, year,
+                            gpa / 1000, gpa % 1000, bench_random(&state) % 121);
+        } else {
+            used += sprintf(buffer + used, "%s %s %s-%d-%d %d.%03d D", first, last, month, day, year,
+                            gpa / 1000, gpa % 1000);
+        }
+        used++; // Keeps the null terminator
+    }
+    *buffer_size = used;
+    return buffer;
+}
+
+double seconds_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+Returns the best time of all rounds in seconds
+*/
+double time_parser(ParseFn parse, const char *lines, size_t buffer_size, const size_t *offsets,
+                   int line_count, int rounds, StudentStore *store) {
+    char *working = (char *) malloc(buffer_size);
+    if (working == NULL) {
+        perror("Failed to allocate.");
+        exit(EXIT_FAILURE);
+    }
+
+    double best = -1;
+    for (int round = 0; round < rounds; round++) {
+        memcpy(working, lines, buffer_size);
+        Arena arena = {0};
+        double start = seconds_now();
+        for (int i = 0; i < line_count; i++) {
+            if (parse(working + offsets[i], store, i, &arena, 1, NULL) != NULL) {
+                fprintf(stderr, "Generated line %d failed to parse\n", i);
+                exit(EXIT_FAILURE);
+            }
+        }
+        double elapsed = seconds_now() - start;
+        if (best < 0 || elapsed < best) best = elapsed;
+        arena_release(&arena);
+    }
+
+    free(working);
+    return best;
+}
+
+void report(const char *name, double seconds, int line_count, double baseline) {
+    printf("%-24s %8.2f ns/line %10.0f lines/s %6.2fx\n", name, seconds * 1e9 / line_count,
+           line_count / seconds, baseline / seconds);
+}
+
+int main(int argc, char **argv) {
+    int line_count = argc > 1 ? atoi(argv[1]) : 1000000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    if (line_count < 1 || rounds < 1) {
+        printf("Usage: %s [line_count] [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t *offsets;
+    size_t buffer_size;
+    char *lines = generate_lines(line_count, &offsets, &buffer_size);
+    StudentStore store = {0};
+    store_reserve(&store, line_count);
+
+    printf("%d lines, best of %d rounds\n", line_count, rounds);
+    double scalar = time_parser(parse_record_scalar, lines, buffer_size, offsets, line_count, rounds, &store);
+    report("parse_record_scalar", scalar, line_count, scalar);
+
+    classify_line = classify_line_scalar;
+    report("fast path (scalar)", time_parser(parse_record, lines, buffer_size, offsets, line_count, rounds, &store),
+           line_count, scalar);
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        classify_line = classify_line_sse2;
+        report("fast path (sse2)", time_parser(parse_record, lines, buffer_size, offsets, line_count, rounds, &store),
+               line_count, scalar);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        classify_line = classify_line_avx2;
+        report("fast path (avx2)", time_parser(parse_record, lines, buffer_size, offsets, line_count, rounds, &store),
+               line_count, scalar);
+    }
+#endif
+
+    store_free(&store);
+    free(offsets);
+    free(lines);
+    return 0;
+}